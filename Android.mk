@@ -7,9 +7,23 @@ LOCAL_SRC_FILES := \
     ph.c \
     server.c \
     config.c \
-    dlist.c \
+    conn.c \
+    event.c \
+    cache.c \
+    ring.c \
     http.c \
-    messages.c
+    messages.c \
+    json.c \
+    worker.c \
+    ingest.c \
+    channel.c \
+    buf.c \
+    outq.c \
+    timer.c \
+    follow.c \
+    gzip.c \
+    stats.c \
+    trigram.c
 
 LOCAL_C_INCLUDES := \
     $(LOCAL_PATH)/
@@ -0,0 +1,287 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+// End to end benchmark: runs ph fed with synthetic lines at a set rate while
+// concurrent keep-alive clients poll it, then reports ingest and request
+// rates and request latency percentiles.
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define E2E_MAX_CLIENTS 256
+#define E2E_RESPONSE_MAX (64 * 1024 * 1024)
+
+typedef struct e2e_client_ {
+    pthread_t thread;
+    unsigned long int requests;
+    unsigned long int errors;
+    double *latency;
+    unsigned long int latency_size;
+} e2e_client_t;
+
+static const char *ph_path = "./ph";
+static int port = 8123;
+static unsigned long int rate = 100000;
+static unsigned int clients_count = 4;
+static unsigned int duration = 5;
+static unsigned int workers = 0;
+static unsigned int lines = 100;
+static volatile int stop;
+
+static double e2e_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int e2e_connect(void) {
+    struct sockaddr_in addr = {0};
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends one request and reads the whole response into buf, returns the
+// response length or -1
+static long int e2e_request(int fd, const char *path, char *buf,
+                            unsigned long int size) {
+    char request[128];
+    unsigned long int len = 0, body = 0, total = 0;
+    int n = snprintf(request, sizeof(request),
+                     "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+    const char *end, *cl;
+    long int rc;
+
+    if (send(fd, request, n, MSG_NOSIGNAL) != n) return -1;
+
+    while (!total || len < total) {
+        if ((rc = recv(fd, buf + len, size - len - 1, 0)) <= 0) return -1;
+        len += rc;
+        buf[len] = '\0';
+        if (!total && (end = strstr(buf, "\r\n\r\n"))) {
+            if ((cl = strcasestr(buf, "Content-Length: ")))
+                body = strtoul(cl + 16, NULL, 10);
+            total = end + 4 - buf + body;
+            if (total >= size) return -1;
+        }
+    }
+    return len;
+}
+
+static void *e2e_feed(void *arg) {
+    int fd = *(int *)arg;
+    char buf[65536];
+    unsigned long int sent = 0, len;
+    double start = e2e_now();
+
+    while (!stop) {
+        // Lines due by now, all that fit in a buffer when unlimited
+        unsigned long int due =
+            rate ? (unsigned long int)((e2e_now() - start) * rate) : ~0UL;
+
+        len = 0;
+        while (sent < due && len < sizeof(buf) - 128) {
+            len += snprintf(buf + len, 128,
+                            "%lu host app[%lu]: request took %lu ms\n", sent,
+                            sent % 997, sent % 1000);
+            sent++;
+        }
+        if (len == 0) {
+            usleep(1000);
+            continue;
+        }
+        if (write(fd, buf, len) < 0) break;
+    }
+    return NULL;
+}
+
+static void *e2e_client(void *arg) {
+    e2e_client_t *client = (e2e_client_t *)arg;
+    char *buf = malloc(E2E_RESPONSE_MAX);
+    char path[32];
+    int fd = e2e_connect();
+
+    snprintf(path, sizeof(path), "/%u", lines);
+    while (!stop && fd >= 0 && buf) {
+        double start = e2e_now();
+
+        if (e2e_request(fd, path, buf, E2E_RESPONSE_MAX) < 0) {
+            client->errors++;
+            close(fd);
+            fd = e2e_connect();
+            continue;
+        }
+        if (client->requests == client->latency_size) {
+            client->latency_size = client->latency_size * 2 + 4096;
+            client->latency = realloc(client->latency,
+                                      client->latency_size * sizeof(double));
+        }
+        client->latency[client->requests++] = e2e_now() - start;
+    }
+    if (fd >= 0) close(fd);
+    free(buf);
+    return NULL;
+}
+
+static int e2e_compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Lines the stdin channel stored, from GET /stats
+static unsigned long int e2e_lines_in(void) {
+    char *buf = malloc(65536), *p;
+    unsigned long int value = 0;
+    int fd = e2e_connect();
+
+    if (fd >= 0 && buf && e2e_request(fd, "/stats", buf, 65536) > 0 &&
+        (p = strstr(buf, "stdin.lines_stored="))) {
+        value = strtoul(p + 19, NULL, 10);
+    }
+    if (fd >= 0) close(fd);
+    free(buf);
+    return value;
+}
+
+static pid_t e2e_start_ph(int *input) {
+    char port_arg[16], workers_arg[16];
+    int fds[2];
+    pid_t pid;
+
+    if (pipe(fds) < 0) return -1;
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    snprintf(workers_arg, sizeof(workers_arg), "%u", workers);
+
+    if ((pid = fork()) == 0) {
+        int null = open("/dev/null", O_WRONLY);
+
+        dup2(fds[0], 0);
+        dup2(null, 1);
+        close(fds[0]);
+        close(fds[1]);
+        execl(ph_path, "ph", "-o", "-p", port_arg, "-l", "10000", "-w",
+              workers_arg, (char *)NULL);
+        perror("exec ph");
+        _exit(1);
+    }
+    close(fds[0]);
+    *input = fds[1];
+
+    return pid;
+}
+
+static void e2e_usage(const char *name) {
+    printf("Usage: %s [-x ph] [-p port] [-r lines/s] [-c clients] "
+           "[-d seconds] [-w workers] [-n lines]\n"
+           "  -r 0 feeds lines as fast as ph takes them\n",
+           name);
+}
+
+int main(int argc, char *argv[]) {
+    e2e_client_t clients[E2E_MAX_CLIENTS] = {{0}};
+    unsigned long int requests = 0, errors = 0, n = 0, lines_in;
+    pthread_t feeder;
+    double start, elapsed, *all;
+    unsigned int i;
+    int input, opt, status;
+    pid_t pid;
+
+    while ((opt = getopt(argc, argv, "x:p:r:c:d:w:n:h")) != -1) {
+        switch (opt) {
+            case 'x': ph_path = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'r': rate = strtoul(optarg, NULL, 10); break;
+            case 'c': clients_count = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'w': workers = atoi(optarg); break;
+            case 'n': lines = atoi(optarg); break;
+            default: e2e_usage(argv[0]); return 1;
+        }
+    }
+    if (clients_count > E2E_MAX_CLIENTS) clients_count = E2E_MAX_CLIENTS;
+
+    signal(SIGPIPE, SIG_IGN);
+    if ((pid = e2e_start_ph(&input)) < 0) {
+        perror("Cannot start ph");
+        return 1;
+    }
+
+    // Wait for the listener
+    for (i = 0; i < 200; i++) {
+        int fd = e2e_connect();
+        if (fd >= 0) {
+            close(fd);
+            break;
+        }
+        usleep(10000);
+    }
+
+    start = e2e_now();
+    pthread_create(&feeder, NULL, e2e_feed, &input);
+    for (i = 0; i < clients_count; i++) {
+        pthread_create(&clients[i].thread, NULL, e2e_client, &clients[i]);
+    }
+
+    sleep(duration);
+    stop = 1;
+    for (i = 0; i < clients_count; i++) {
+        pthread_join(clients[i].thread, NULL);
+    }
+    elapsed = e2e_now() - start;
+    lines_in = e2e_lines_in();
+
+    kill(pid, SIGTERM);
+    close(input);
+    pthread_join(feeder, NULL);
+    waitpid(pid, &status, 0);
+
+    for (i = 0; i < clients_count; i++) {
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+    }
+    all = malloc((requests + 1) * sizeof(double));
+    for (i = 0; i < clients_count; i++) {
+        memcpy(all + n, clients[i].latency,
+               clients[i].requests * sizeof(double));
+        n += clients[i].requests;
+        free(clients[i].latency);
+    }
+    qsort(all, n, sizeof(double), e2e_compare);
+
+    printf("ph %s: %u clients GET /%u, %u workers, feed %lu lines/s%s\n",
+           ph_path, clients_count, lines, workers, rate,
+           rate ? "" : " (unlimited)");
+    printf("lines/s     %12.0f\n", lines_in / elapsed);
+    printf("requests/s  %12.0f (%lu errors)\n", requests / elapsed, errors);
+    if (n > 0) {
+        printf("latency us  p50 %.1f p99 %.1f max %.1f\n",
+               all[n / 2] * 1e6, all[n * 99 / 100] * 1e6, all[n - 1] * 1e6);
+    }
+    free(all);
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,301 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+// Microbenchmarks of the ingest and serving hot paths
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "gzip.h"
+#include "http.h"
+#include "json.h"
+#include "messages.h"
+#include "ring.h"
+
+#define BENCH_LINES 10000
+#define BENCH_LINE_MAX 200
+#define BENCH_INPUT (4 * 1024 * 1024)
+// Minimum run time of each benchmark in seconds
+#define BENCH_TIME 0.5
+
+static char *input;
+static unsigned long int input_len;
+static unsigned long int input_lines;
+
+static double bench_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_report(const char *name, unsigned long int ops,
+                         unsigned long int bytes, double elapsed) {
+    printf("%-28s %12.0f ops/s %10.1f ns/op", name, ops / elapsed,
+           elapsed * 1e9 / ops);
+    if (bytes) printf(" %9.1f MB/s", bytes / elapsed / (1024 * 1024));
+    printf("\n");
+}
+
+// Log like lines of varying length, like the ones ph usually gets
+static void bench_input_init(void) {
+    unsigned long int n = 0;
+
+    input = malloc(BENCH_INPUT + BENCH_LINE_MAX);
+    srand(1);
+    while (input_len < BENCH_INPUT) {
+        int len = snprintf(input + input_len, BENCH_LINE_MAX,
+                           "2021-06-01T12:00:%02lu host app[%lu]: request %lu"
+                           " took %d ms",
+                           n % 60, n % 997, n, rand() % 1000);
+        int pad = rand() % 100;
+
+        memset(input + input_len + len, 'x', pad);
+        input_len += len + pad;
+        input[input_len++] = '\n';
+        n++;
+    }
+    input_lines = n;
+}
+
+// Feeds the input in read() sized pieces
+static void bench_feed(ph_messages_t *m, unsigned int block) {
+    unsigned long int off = 0;
+    unsigned int len;
+
+    while (off < input_len) {
+        len = input_len - off < 65536 ? input_len - off : 65536;
+        message_input_data(m, input + off, len, 0, block);
+        if (block) message_check_save(m, 0);
+        off += len;
+    }
+}
+
+static void bench_ingest(const char *name, unsigned int block) {
+    ph_messages_t m;
+    unsigned long int rounds = 0;
+    double start, elapsed;
+
+    messages_init(&m, BENCH_LINES, 0, NULL, 0);
+    start = bench_now();
+    do {
+        bench_feed(&m, block);
+        rounds++;
+    } while ((elapsed = bench_now() - start) < BENCH_TIME);
+    bench_report(name, rounds * input_lines, rounds * input_len, elapsed);
+    message_free(&m);
+}
+
+// Full ring, every insert evicts the oldest entry
+static void bench_ring_evict(void) {
+    ph_ring_t ring;
+    unsigned long int ops = 0, bytes = 0, off = 0;
+    double start, elapsed;
+    const char *eol;
+
+    ring_init(&ring, 1000);
+    start = bench_now();
+    do {
+        unsigned int i;
+
+        for (i = 0; i < 10000; i++) {
+            eol = memchr(input + off, '\n', input_len - off);
+            ring_insert(&ring, input + off, eol + 1 - (input + off), NULL, 0,
+                        ops, ops);
+            bytes += eol + 1 - (input + off);
+            off = eol + 1 - input;
+            if (off >= input_len) off = 0;
+            ops++;
+        }
+    } while ((elapsed = bench_now() - start) < BENCH_TIME);
+    bench_report("ring_insert (evicting)", ops, bytes, elapsed);
+    ring_free(&ring);
+}
+
+// Time lookups of /range over entries a microsecond apart
+static void bench_ring_find(void) {
+    ph_ring_t ring;
+    ph_ring_view_t view;
+    unsigned long int ops = 0;
+    // Keeps the lookups from being optimized away
+    volatile uint64_t found = 0;
+    double start, elapsed;
+    unsigned int i;
+
+    ring_init(&ring, BENCH_LINES);
+    for (i = 0; i < BENCH_LINES; i++) {
+        ring_insert(&ring, "x\n", 2, NULL, 0, i, i * 1000ULL);
+    }
+    ring_read_begin(&ring, &view);
+    start = bench_now();
+    do {
+        for (i = 0; i < 10000; i++) {
+            found += ring_view_find(&view, (ops + i) % BENCH_LINES * 1000ULL);
+        }
+        ops += i;
+    } while ((elapsed = bench_now() - start) < BENCH_TIME);
+    ring_read_end(&ring);
+    bench_report("ring_view_find", ops, 0, elapsed);
+    ring_free(&ring);
+}
+
+static void bench_format(ph_messages_t *m, const char *name,
+                         unsigned int lines, int format,
+                         const char *delimiter) {
+    unsigned long int ops = 0, bytes = 0, len;
+    ph_ring_range_t range;
+    double start, elapsed;
+    char *body;
+
+    start = bench_now();
+    do {
+        body = messages_get_formated(m, 0, lines, format,
+                                     delimiter ? "[" : NULL,
+                                     delimiter ? "]" : NULL, delimiter, &len,
+                                     &range);
+        free(body);
+        bytes += len;
+        ops++;
+    } while ((elapsed = bench_now() - start) < BENCH_TIME);
+    bench_report(name, ops, bytes, elapsed);
+}
+
+// What ingest does for JSON, a scan of every line and escaping the ones that
+// need it. With quotes every line gets a quote in its text.
+static void bench_json(const char *name, unsigned int quotes) {
+    unsigned long int ops = 0, bytes = 0, off = 0;
+    double start, elapsed;
+    unsigned int len, clean;
+    const char *eol;
+    char *text = malloc(input_len);
+    char *out = malloc(BENCH_LINE_MAX * 6);
+
+    memcpy(text, input, input_len);
+    for (; quotes && off < input_len; off = eol + 1 - text) {
+        eol = memchr(text + off, '\n', input_len - off);
+        text[off + 4] = '"';
+    }
+    off = 0;
+    start = bench_now();
+    do {
+        unsigned int i;
+
+        for (i = 0; i < 10000; i++) {
+            eol = memchr(text + off, '\n', input_len - off);
+            len = eol - (text + off);
+            if ((clean = json_scan(text + off, len)) < len &&
+                json_escaped_len(text + off, len) <= BENCH_LINE_MAX * 6) {
+                json_escape(out, text + off, len);
+            }
+            bytes += len + 1;
+            off = eol + 1 - text;
+            if (off >= input_len) off = 0;
+            ops++;
+        }
+    } while ((elapsed = bench_now() - start) < BENCH_TIME);
+    bench_report(name, ops, bytes, elapsed);
+    free(out);
+    free(text);
+}
+
+static void bench_http_parse(void) {
+    const char *request =
+        "GET /100 HTTP/1.1\r\nHost: localhost:8000\r\n"
+        "User-Agent: curl/7.68.0\r\nAccept: */*\r\n"
+        "Accept-Encoding: gzip, deflate\r\n\r\n";
+    unsigned int len = strlen(request), scanned;
+    unsigned long int ops = 0;
+    ph_http_request_t req;
+    double start, elapsed;
+    void *result;
+
+    start = bench_now();
+    do {
+        scanned = 0;
+        result = NULL;
+        http_parse(request, len, &scanned, &req);
+        http_parse_request(&req, &result);
+        free(result);
+        ops++;
+    } while ((elapsed = bench_now() - start) < BENCH_TIME);
+    bench_report("http_parse + parse_request", ops, 0, elapsed);
+}
+
+static void bench_response_iov(ph_messages_t *m, unsigned int lines) {
+    unsigned long int ops = 0;
+    ph_http_range_t range = {0};
+    ph_ring_view_t view;
+    double start, elapsed;
+    char header[512];
+    struct iovec *iov;
+    int iovcnt;
+
+    start = bench_now();
+    do {
+        messages_read_begin(m, &view);
+        iov = http_response_lines_iov(&view, header, sizeof(header), lines,
+                                      NULL, NULL, NULL, &range, NULL, 1,
+                                      &iovcnt);
+        messages_read_end(m, &view, view.first);
+        free(iov);
+        ops++;
+    } while ((elapsed = bench_now() - start) < BENCH_TIME);
+    bench_report("http_response_lines_iov 1000", ops, 0, elapsed);
+}
+
+static void bench_gzip(ph_messages_t *m) {
+    unsigned long int ops = 0, bytes = 0, len, out_len = 0;
+    ph_ring_range_t range;
+    double start, elapsed;
+    char *body, *out;
+
+    body = messages_get_formated(m, 0, 1000, PH_FORMAT_RAW, NULL, NULL, NULL,
+                                 &len, &range);
+    start = bench_now();
+    do {
+        out = gzip_compress(body, len, PH_ENCODING_GZIP, &out_len);
+        free(out);
+        bytes += len;
+        ops++;
+    } while ((elapsed = bench_now() - start) < BENCH_TIME);
+    bench_report("gzip_compress 1000 lines", ops, bytes, elapsed);
+    printf("%-28s %12.2f ratio\n", "", (double)len / out_len);
+    free(body);
+}
+
+int main(void) {
+    ph_messages_t m;
+
+    bench_input_init();
+    printf("Input: %lu lines, %lu bytes\n", input_lines, input_len);
+
+    bench_ingest("ingest lines", 0);
+    bench_ingest("ingest blocks", 1);
+    bench_ring_evict();
+    bench_ring_find();
+
+    messages_init(&m, BENCH_LINES, 0, NULL, 0);
+    bench_feed(&m, 0);
+    bench_format(&m, "messages_get_formated 1", 1, PH_FORMAT_RAW, NULL);
+    bench_format(&m, "messages_get_formated 1000", 1000, PH_FORMAT_RAW, NULL);
+    bench_format(&m, "messages_get_formated all", 0, PH_FORMAT_RAW, NULL);
+    bench_format(&m, "formated 1000 delimited", 1000, PH_FORMAT_RAW, ",");
+    bench_format(&m, "formated 1000 json", 1000, PH_FORMAT_JSON, NULL);
+    bench_format(&m, "formated 1000 ndjson", 1000, PH_FORMAT_NDJSON, NULL);
+    bench_json("json_scan clean lines", 0);
+    bench_json("json_escape quoted lines", 1);
+    bench_http_parse();
+    bench_response_iov(&m, 1000);
+    bench_gzip(&m);
+    message_free(&m);
+
+    free(input);
+
+    return 0;
+}
\ No newline at end of file
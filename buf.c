@@ -0,0 +1,53 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#include "buf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+ph_buf_t *buf_new(unsigned long int len) {
+    ph_buf_t *buf;
+
+    if (!(buf = (ph_buf_t *)malloc(sizeof(ph_buf_t) + len))) {
+        fprintf(stderr, "Cannot allocate %lu bytes buffer\n", len);
+        return NULL;
+    }
+    buf->refs = 1;
+    buf->len = len;
+    buf->data = buf->storage;
+
+    return buf;
+}
+
+// Takes ownership of data, it is freed with the buffer. data is freed right
+// away when no buffer can be allocated.
+ph_buf_t *buf_wrap(char *data, unsigned long int len) {
+    ph_buf_t *buf;
+
+    if (!(buf = (ph_buf_t *)malloc(sizeof(ph_buf_t)))) {
+        fprintf(stderr, "Cannot allocate buffer\n");
+        free(data);
+        return NULL;
+    }
+    buf->refs = 1;
+    buf->len = len;
+    buf->data = data;
+
+    return buf;
+}
+
+ph_buf_t *buf_ref(ph_buf_t *buf) {
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+void buf_unref(ph_buf_t *buf) {
+    if (buf && __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (buf->data != buf->storage) free(buf->data);
+        free(buf);
+    }
+}
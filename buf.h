@@ -0,0 +1,24 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_BUF_H
+#define __PH_BUF_H
+
+// Immutable once filled, shared by reference between connections. Data is
+// either stored right after the header or a malloc()ed block the buffer owns.
+typedef struct ph_buf_ {
+    int refs;
+    unsigned long int len;
+    char *data;
+    char storage[];
+} ph_buf_t;
+
+ph_buf_t *buf_new(unsigned long int len);
+ph_buf_t *buf_wrap(char *data, unsigned long int len);
+ph_buf_t *buf_ref(ph_buf_t *buf);
+void buf_unref(ph_buf_t *buf);
+
+#endif
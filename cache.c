@@ -0,0 +1,112 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+
+// One cache per serving thread so lookups never need a lock
+static __thread ph_cache_entry_t entries[PH_CACHE_ENTRIES];
+static __thread unsigned long int cache_tick = 0;
+
+static int cache_str_equal(const char *a, const char *b) {
+    if (a == b) return 1;
+    if (!a || !b) return 0;
+    return strcmp(a, b) == 0;
+}
+
+static int cache_key_equal(const ph_cache_key_t *a, const ph_cache_key_t *b) {
+    return a->channel == b->channel && a->lines == b->lines &&
+           a->since == b->since &&
+           a->format == b->format && a->encoding == b->encoding &&
+           cache_str_equal(a->prefix, b->prefix) &&
+           cache_str_equal(a->suffix, b->suffix) &&
+           cache_str_equal(a->line_delimiter, b->line_delimiter);
+}
+
+static void cache_entry_free(ph_cache_entry_t *e) {
+    buf_unref(e->buf);
+    memset(e, 0, sizeof(ph_cache_entry_t));
+}
+
+// Returns the cached response or NULL, it stays valid until the next
+// cache_put() unless a reference is taken. On a miss seen is set when the key
+// was already requested in this generation, so one-off requests are served
+// without ever being copied and only repeated ones are materialized in the
+// cache.
+ph_buf_t *cache_get(const ph_cache_key_t *key, unsigned long int generation,
+                    ph_ring_range_t *range, int *seen) {
+    int i;
+
+    *seen = 0;
+
+    for (i = 0; i < PH_CACHE_ENTRIES; i++) {
+        ph_cache_entry_t *e = &entries[i];
+
+        if (!e->used || e->generation != generation) continue;
+        if (!cache_key_equal(&e->key, key)) continue;
+
+        e->last_used = ++cache_tick;
+        *seen = 1;
+        if (!e->buf) return NULL;
+
+        *range = e->range;
+        debug_print("Cache hit: lines %u generation %lu\n", key->lines,
+                    generation);
+        return e->buf;
+    }
+
+    return NULL;
+}
+
+// Takes over the reference to buf, a NULL buf only records that the key was
+// seen and range may be NULL too.
+// Entries of the channel from older generations can never be hit again so they
+// are released here instead of waiting for eviction.
+ph_buf_t *cache_put(const ph_cache_key_t *key, unsigned long int generation,
+                    ph_buf_t *buf, const ph_ring_range_t *range) {
+    ph_cache_entry_t *victim = NULL;
+    int i;
+
+    for (i = 0; i < PH_CACHE_ENTRIES; i++) {
+        ph_cache_entry_t *e = &entries[i];
+
+        if (e->used && ((e->key.channel == key->channel &&
+                         e->generation != generation) ||
+                        cache_key_equal(&e->key, key))) {
+            cache_entry_free(e);
+        }
+        if (!e->used) {
+            if (!victim || victim->used) victim = e;
+        } else if (!victim ||
+                   (victim->used && e->last_used < victim->last_used)) {
+            victim = e;
+        }
+    }
+
+    if (victim->used) cache_entry_free(victim);
+
+    victim->used = 1;
+    victim->key = *key;
+    victim->generation = generation;
+    victim->last_used = ++cache_tick;
+    victim->buf = buf;
+    if (range) victim->range = *range;
+
+    return buf;
+}
+
+void cache_clear(void) {
+    int i;
+
+    for (i = 0; i < PH_CACHE_ENTRIES; i++) {
+        if (entries[i].used) cache_entry_free(&entries[i]);
+    }
+}
@@ -0,0 +1,55 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_CACHE_H
+#define __PH_CACHE_H
+
+#include <stdint.h>
+
+#include "buf.h"
+#include "ring.h"
+
+#define PH_CACHE_ENTRIES 8
+
+enum cache_format {
+    PH_FORMAT_RAW = 0,
+    // Each message prefixed with its ingest time
+    PH_FORMAT_TS,
+    // A JSON array of objects with seq, ts and data, or one object per line
+    PH_FORMAT_JSON,
+    PH_FORMAT_NDJSON,
+    PH_FORMAT_MAX
+};
+
+// Key strings are not copied, they must outlive the cache entry
+typedef struct ph_cache_key_ {
+    unsigned int channel;
+    unsigned int lines;
+    uint64_t since;
+    int format;
+    // Compressed copies are cached next to the plain body
+    int encoding;
+    const char *prefix;
+    const char *suffix;
+    const char *line_delimiter;
+} ph_cache_key_t;
+
+typedef struct ph_cache_entry_ {
+    int used;
+    ph_cache_key_t key;
+    unsigned long int generation;
+    unsigned long int last_used;
+    ph_buf_t *buf;
+    ph_ring_range_t range;
+} ph_cache_entry_t;
+
+ph_buf_t *cache_get(const ph_cache_key_t *key, unsigned long int generation,
+                    ph_ring_range_t *range, int *seen);
+ph_buf_t *cache_put(const ph_cache_key_t *key, unsigned long int generation,
+                    ph_buf_t *buf, const ph_ring_range_t *range);
+void cache_clear(void);
+
+#endif
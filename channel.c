@@ -0,0 +1,108 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#include "channel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+
+// Created before any server starts and fixed afterwards, so lookups from
+// worker threads need no lock
+static ph_channel_t *channels = NULL;
+static unsigned int count = 0;
+
+int channels_init(ph_config_t *config) {
+    unsigned int i;
+
+    if (!(channels = (ph_channel_t *)calloc(config->channels_count + 1,
+                                            sizeof(ph_channel_t)))) {
+        fprintf(stderr, "Cannot allocate channels\n");
+        return -1;
+    }
+
+    for (i = 0; i <= config->channels_count; i++) {
+        ph_channel_t *channel = &channels[i];
+
+        channel->id = i;
+        channel->config = i == 0 ? config : &config->channels[i - 1];
+        channel->name = channel->config->name;
+
+        if (messages_init(&channel->messages, channel->config->max_lines,
+                          channel->config->max_bytes,
+                          channel->config->store_file,
+                          (uint64_t)channel->config->store_size << 20) < 0) {
+            channels_free();
+            return -1;
+        }
+        count++;
+        messages_rate(&channel->messages, channel->config->rate,
+                      channel->config->burst, channel->config->rate_latest);
+
+        if (channel->config->grep_index &&
+            messages_index(&channel->messages) < 0) {
+            channels_free();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void channels_free(void) {
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        message_free(&channels[i].messages);
+    }
+    free(channels);
+    channels = NULL;
+    count = 0;
+}
+
+unsigned int channels_count(void) {
+    return count;
+}
+
+ph_channel_t *channel_get(unsigned int id) {
+    return id < count ? &channels[id] : NULL;
+}
+
+ph_channel_t *channel_find(const char *name) {
+    unsigned int i;
+
+    for (i = 1; i < count; i++) {
+        if (strcmp(channels[i].name, name) == 0) return &channels[i];
+    }
+    return NULL;
+}
+
+// Opens the channel input without blocking. A FIFO is opened for writing
+// too so it doesn't read as closed while no writer is attached.
+int channel_open(ph_channel_t *channel) {
+    const char *path = channel->config->path;
+    struct stat st;
+    int fd, flags = O_RDONLY;
+
+    if (stat(path, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        flags = O_RDWR;
+    }
+
+    if ((fd = open(path, flags | O_NONBLOCK | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Cannot open channel %s input %s: %s\n", channel->name,
+                path, strerror(errno));
+        return -1;
+    }
+
+    debug_print("Channel %s reading %s\n", channel->name, path);
+
+    return fd;
+}
\ No newline at end of file
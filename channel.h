@@ -0,0 +1,28 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_CHANNEL_H
+#define __PH_CHANNEL_H
+
+#include "config.h"
+#include "messages.h"
+
+// Channel 0 is stdin with the global settings, named channels follow
+typedef struct ph_channel_ {
+    unsigned int id;
+    const char *name;
+    ph_config_t *config;
+    ph_messages_t messages;
+} ph_channel_t;
+
+int channels_init(ph_config_t *config);
+void channels_free(void);
+unsigned int channels_count(void);
+ph_channel_t *channel_get(unsigned int id);
+ph_channel_t *channel_find(const char *name);
+int channel_open(ph_channel_t *channel);
+
+#endif
\ No newline at end of file
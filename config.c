@@ -8,6 +8,7 @@
 #include "config.h"
 
 #include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,25 +18,140 @@ ph_config_t config = {.port = DEFAULT_SERVER_PORT,
                       .addr = DEFAULT_SERVER_ADDR,
                       .timeout = -1,
                       .output_stdin = 1,
+                      .block_mode = 0,
+                      .grep_index = 0,
                       .rate = 0,
+                      .burst = 1,
+                      .rate_latest = 0,
                       .max_lines = DEFAULT_MAX_LINES,
+                      .max_bytes = 0,
+                      .max_clients = DEFAULT_SERVER_MAX_CLIENTS,
+                      .workers = 0,
+                      .idle_timeout = DEFAULT_IDLE_TIMEOUT * 1000,
+                      .request_timeout = DEFAULT_REQUEST_TIMEOUT * 1000,
+                      .write_timeout = DEFAULT_WRITE_TIMEOUT * 1000,
                       .body_prefix = NULL,
                       .body_suffix = NULL,
-                      .line_delimiter = NULL};
+                      .line_delimiter = NULL,
+                      .store_file = NULL,
+                      .store_size = DEFAULT_STORE_SIZE,
+                      .name = NULL,
+                      .path = NULL,
+                      .channels = NULL,
+                      .channels_count = 0};
+
+// Parses a byte count with an optional K, M or G suffix
+unsigned long int config_parse_bytes(const char *arg) {
+    char *end;
+    unsigned long int bytes = strtoul(arg, &end, 10);
+
+    switch (*end) {
+        case 'g':
+        case 'G':
+            bytes <<= 10;
+            /* fall through */
+        case 'm':
+        case 'M':
+            bytes <<= 10;
+            /* fall through */
+        case 'k':
+        case 'K':
+            bytes <<= 10;
+            break;
+    }
+    return bytes;
+}
+
+// Parses seconds with an optional fraction into milliseconds
+unsigned int config_parse_rate(const char *arg) {
+    double seconds = strtod(arg, NULL);
+
+    if (!(seconds > 0)) return 0;
+    if (seconds >= UINT_MAX / 1000.0) return UINT_MAX;
+
+    return (unsigned int)(seconds * 1000 + 0.5);
+}
+
+// Adds the channel from a name=path argument. It starts with the settings
+// given so far and the per channel options that follow apply to it.
+static ph_config_t *config_add_channel(ph_config_t *config, char *arg) {
+    char *path = strchr(arg, '=');
+    ph_config_t *channels, *channel;
+    unsigned int i, len;
+
+    if (!path || path == arg || !*(path + 1)) {
+        fprintf(stderr, "Channel must be given as name=path: %s\n", arg);
+        return NULL;
+    }
+    *path++ = '\0';
+
+    len = strlen(arg);
+    if (len >= PH_CONFIG_MAX_CHANNEL_NAME ||
+        strspn(arg, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                    "0123456789_-.") != len) {
+        fprintf(stderr, "Invalid channel name: %s\n", arg);
+        return NULL;
+    }
+
+    for (i = 0; i < config->channels_count; i++) {
+        if (strcmp(config->channels[i].name, arg) == 0) {
+            fprintf(stderr, "Duplicate channel name: %s\n", arg);
+            return NULL;
+        }
+    }
+
+    if (config->channels_count == PH_CONFIG_MAX_CHANNELS) {
+        fprintf(stderr, "Too many channels, max %d\n", PH_CONFIG_MAX_CHANNELS);
+        return NULL;
+    }
+
+    if (!(channels = (ph_config_t *)realloc(
+              config->channels,
+              (config->channels_count + 1) * sizeof(ph_config_t)))) {
+        fprintf(stderr, "Cannot allocate channel\n");
+        return NULL;
+    }
+    config->channels = channels;
+
+    channel = &channels[config->channels_count++];
+    *channel = *config;
+    channel->name = arg;
+    channel->path = path;
+    // Only stdin is passed through
+    channel->output_stdin = 0;
+    // A store file can't be shared
+    channel->store_file = NULL;
+    channel->channels = NULL;
+    channel->channels_count = 0;
+
+    return channel;
+}
 
 void config_parse_opts(int argc, char **argv, ph_config_t *config) {
+    // Options setting up a store go to the last channel given
+    ph_config_t *target = config;
     int opt, rc;
 
     if (!config) return;
 
-    while ((opt = getopt(argc, argv, "l:p:a:b:s:d:t:r:ohV")) != -1) {
+    while ((opt = getopt(argc, argv,
+                         "l:m:p:a:b:s:d:t:k:H:W:r:R:c:w:i:f:F:BLgohV")) !=
+           -1) {
         switch (opt) {
+            case 'i':
+                if (!(target = config_add_channel(config, optarg))) {
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'l':
-                rc = sscanf(optarg, "%u", &config->max_lines);
+                rc = sscanf(optarg, "%u", &target->max_lines);
                 if (rc < 1) {
-                    config->rate = DEFAULT_MAX_LINES;
+                    target->max_lines = DEFAULT_MAX_LINES;
                 }
                 break;
+            case 'm':
+                target->max_bytes = config_parse_bytes(optarg);
+                break;
             case 'p':
                 rc = sscanf(optarg, "%hu", &config->port);
                 if (rc < 1) {
@@ -48,27 +164,69 @@ void config_parse_opts(int argc, char **argv, ph_config_t *config) {
                     config->timeout = -1;
                 }
                 break;
+            case 'k':
+                config->idle_timeout = config_parse_rate(optarg);
+                break;
+            case 'H':
+                config->request_timeout = config_parse_rate(optarg);
+                break;
+            case 'W':
+                config->write_timeout = config_parse_rate(optarg);
+                break;
             case 'r':
-                rc = sscanf(optarg, "%u", &config->rate);
+                target->rate = config_parse_rate(optarg);
+                break;
+            case 'R':
+                rc = sscanf(optarg, "%u", &target->burst);
+                if (rc < 1 || target->burst == 0) {
+                    target->burst = 1;
+                }
+                break;
+            case 'L':
+                target->rate_latest = 1;
+                break;
+            case 'c':
+                rc = sscanf(optarg, "%u", &config->max_clients);
+                if (rc < 1) {
+                    config->max_clients = DEFAULT_SERVER_MAX_CLIENTS;
+                }
+                break;
+            case 'w':
+                rc = sscanf(optarg, "%u", &config->workers);
                 if (rc < 1) {
-                    config->rate = 0;
+                    config->workers = 0;
                 }
                 break;
             case 'a':
                 config->addr = optarg;
                 break;
             case 'b':
-                config->body_prefix = optarg;
+                target->body_prefix = optarg;
                 break;
             case 's':
-                config->body_suffix = optarg;
+                target->body_suffix = optarg;
                 break;
             case 'd':
-                config->line_delimiter = optarg;
+                target->line_delimiter = optarg;
                 break;
             case 'o':
                 config->output_stdin = 0;
                 break;
+            case 'B':
+                target->block_mode = 1;
+                break;
+            case 'g':
+                target->grep_index = 1;
+                break;
+            case 'f':
+                target->store_file = optarg;
+                break;
+            case 'F':
+                rc = sscanf(optarg, "%u", &target->store_size);
+                if (rc < 1 || target->store_size == 0) {
+                    target->store_size = DEFAULT_STORE_SIZE;
+                }
+                break;
             case 'V':
             case 'h':
             default:
@@ -79,17 +237,34 @@ void config_parse_opts(int argc, char **argv, ph_config_t *config) {
     }
 }
 
+// val points to a long int. Workers may call it while other threads read
+// the config, the fields are read with config_get().
 int config_set_key(ph_config_t *config, const char *key, const void *val) {
+    long int v;
+
     if (key == NULL || val == NULL) return -1;
 
-    if (strcmp(key, "rate") == 0) {        
-        config->rate = (*(unsigned int *)val);
+    v = *(const long int *)val;
+
+    if (strcmp(key, "rate") == 0) {
+        __atomic_store_n(&config->rate, (unsigned int)v, __ATOMIC_RELAXED);
+    } else if (strcmp(key, "burst") == 0) {
+        __atomic_store_n(&config->burst, v > 0 ? (unsigned int)v : 1,
+                         __ATOMIC_RELAXED);
+    } else if (strcmp(key, "latest") == 0) {
+        __atomic_store_n(&config->rate_latest, (unsigned short int)v,
+                         __ATOMIC_RELAXED);
     } else if (strcmp(key, "max_lines") == 0) {
-        config->max_lines = (*(unsigned int *)val);
+        __atomic_store_n(&config->max_lines, (unsigned int)v,
+                         __ATOMIC_RELAXED);
+    } else if (strcmp(key, "max_bytes") == 0) {
+        __atomic_store_n(&config->max_bytes, (unsigned long int)v,
+                         __ATOMIC_RELAXED);
     } else if (strcmp(key, "output_stdin") == 0) {
-        config->output_stdin = (*(unsigned short int *)val);
+        __atomic_store_n(&config->output_stdin, (unsigned short int)v,
+                         __ATOMIC_RELAXED);
     } else if (strcmp(key, "timeout") == 0) {
-        config->timeout = (*(int *)val);
+        __atomic_store_n(&config->timeout, (int)v, __ATOMIC_RELAXED);
     } else {
         return -1;
     }
@@ -98,6 +273,8 @@ int config_set_key(ph_config_t *config, const char *key, const void *val) {
 }
 
 void config_print(ph_config_t *config) {
+    unsigned int i;
+
     if (!config) return;
 
     fprintf(stderr,
@@ -106,14 +283,54 @@ void config_print(ph_config_t *config) {
             "\taddr: %s\n"
             "\ttimeout: %d\n"
             "\toutput stdin: %d\n"
-            "\trate: %d seconds\n"
+            "\tblock mode: %d\n"
+            "\tgrep index: %d\n"
+            "\trate: %u.%03u seconds, burst %u%s\n"
             "\tmax_lines: %d\n"
+            "\tmax_bytes: %lu\n"
+            "\tmax_clients: %d\n"
+            "\tworkers: %d\n"
+            "\tidle timeout: %u.%03u seconds\n"
+            "\trequest timeout: %u.%03u seconds\n"
+            "\twrite timeout: %u.%03u seconds\n"
             "\tbody_prefix: %s\n"
             "\tbody_suffix: %s\n"
-            "\tline_delimiter: %s\n",
+            "\tline_delimiter: %s\n"
+            "\tstore file: %s (%u MB)\n",
             config->port, config->addr, config->timeout, config->output_stdin,
-            config->rate, config->max_lines, config->body_prefix,
-            config->body_suffix, config->line_delimiter);
+            config->block_mode, config->grep_index, config->rate / 1000,
+            config->rate % 1000, config->burst,
+            config->rate_latest ? ", latest" : "", config->max_lines,
+            config->max_bytes, config->max_clients, config->workers,
+            config->idle_timeout / 1000, config->idle_timeout % 1000,
+            config->request_timeout / 1000, config->request_timeout % 1000,
+            config->write_timeout / 1000, config->write_timeout % 1000,
+            config->body_prefix, config->body_suffix, config->line_delimiter,
+            config->store_file, config->store_size);
+
+    for (i = 0; i < config->channels_count; i++) {
+        ph_config_t *channel = &config->channels[i];
+
+        fprintf(stderr,
+                "Channel %s: %s\n"
+                "\tblock mode: %d\n"
+                "\tgrep index: %d\n"
+                "\trate: %u.%03u seconds, burst %u%s\n"
+                "\tmax_lines: %d\n"
+                "\tmax_bytes: %lu\n"
+                "\tbody_prefix: %s\n"
+                "\tbody_suffix: %s\n"
+                "\tline_delimiter: %s\n"
+                "\tstore file: %s (%u MB)\n",
+                channel->name, channel->path, channel->block_mode,
+                channel->grep_index, channel->rate / 1000, channel->rate % 1000,
+                channel->burst, channel->rate_latest ? ", latest" : "",
+                channel->max_lines,
+                channel->max_bytes,
+                channel->body_prefix,
+                channel->body_suffix, channel->line_delimiter,
+                channel->store_file, channel->store_size);
+    }
 }
 
 void config_help(void) {
@@ -128,19 +345,48 @@ void config_help(void) {
         "  -a <addr>       - The address to bind. Default any\n"
         "  -p <port>       - The port to bind. Default %d\n"
         "  -l <number>     - Max number of lines to hold. Default %d\n"
+        "  -m <bytes>      - Max bytes of lines to hold, K, M and G suffixes "
+        "are known. Default no limit.\n"
+        "  -c <number>     - Max number of connected clients. Default %d\n"
+        "  -w <threads>    - Number of HTTP worker threads. Default 0, serve "
+        "from the input thread.\n"
         "  -t <seconds>    - Inactivity timeout in seconds. Default infinite.\n"
+        "  -k <seconds>    - Close connections waiting this long for a "
+        "request, 0 never. Default %d\n"
+        "  -H <seconds>    - Close connections taking longer to send a "
+        "request, 0 never. Default %d\n"
+        "  -W <seconds>    - Close connections that don't read their output "
+        "for this long, 0 never. Default %d\n"
         "  -b <string>     - String to append at the begining of response. "
         "Default none.\n"
         "  -s <string>     - String to append at end of response. Default "
         "none.\n"
         "  -d <string>     - Line delimiter string to append between lines "
         "(except last line). Default none.\n"
-        "  -r <seconds>    - Rate limiting incoming lines. Lines comming "
-        "faster "
-        "will be ignored. Default no limit.\n"
+        "  -r <seconds>    - Rate limiting incoming lines, one line every "
+        "seconds, fractions like 0.1 are allowed. Lines comming faster will "
+        "be ignored. Default no limit.\n"
+        "  -R <number>     - Lines that may pass at once after a quiet "
+        "period when rate limiting. Default 1\n"
+        "  -L              - When rate limiting keep the newest line that "
+        "came too fast and store it once allowed instead of dropping it.\n"
+        "  -B              - Block mode, store each burst of input ending in "
+        "a newline as one block instead of one message per line.\n"
+        "  -g              - Keep a trigram index of the lines so /grep "
+        "queries don't scan the whole buffer. Uses about 4 bytes per line "
+        "byte.\n"
+        "  -i <name=path>  - Also read the FIFO or file at path as channel "
+        "name, served under /ch/name/. Options -l -m -r -R -L -b -s -d -B -g "
+        "-f -F that follow apply to this channel.\n"
+        "  -f <file>       - Keep the messages in file so they survive restarts."
+        " Default in memory only.\n"
+        "  -F <megabytes>  - Size of the messages in the -f file, old messages "
+        "are dropped to fit. Default %d\n"
         "  -o              - Don't output stdin to stdout\n"
         "  -h              - This help.\n"
         "  -V              - Display version information and exit.\n"
         "\n\n",
-        DEFAULT_SERVER_PORT, DEFAULT_MAX_LINES);
+        DEFAULT_SERVER_PORT, DEFAULT_MAX_LINES, DEFAULT_SERVER_MAX_CLIENTS,
+        DEFAULT_IDLE_TIMEOUT, DEFAULT_REQUEST_TIMEOUT, DEFAULT_WRITE_TIMEOUT,
+        DEFAULT_STORE_SIZE);
 }
\ No newline at end of file
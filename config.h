@@ -16,22 +16,60 @@
 #define READ_BUF_LEN 4096
 #define MAX_READ_SIZE READ_BUF_LEN * 1024
 #define DEFAULT_MAX_LINES 1000
+#define DEFAULT_STORE_SIZE 16
+// Connection timeouts in seconds
+#define DEFAULT_IDLE_TIMEOUT 60
+#define DEFAULT_REQUEST_TIMEOUT 10
+#define DEFAULT_WRITE_TIMEOUT 30
+#define PH_CONFIG_MAX_CHANNELS 64
+#define PH_CONFIG_MAX_CHANNEL_NAME 32
 
 typedef struct ph_config_
 {
     unsigned short int port;
     unsigned short int output_stdin;
+    unsigned short int block_mode;
+    // Keep a trigram index of the messages for /grep
+    unsigned short int grep_index;
     int timeout;
     unsigned int max_lines;
+    unsigned long int max_bytes;
+    unsigned int max_clients;
+    unsigned int workers;
+    // Connection timeouts in ms, 0 disables them. Idle is the wait for a
+    // request, request the time to receive one once it started and write
+    // how long queued output may go without progress.
+    unsigned int idle_timeout;
+    unsigned int request_timeout;
+    unsigned int write_timeout;
+    // Rate limiting, one stored line every rate ms with up to burst of them
+    // passing at once. Latest stores the newest line that came too fast
+    // once allowed instead of dropping it.
     unsigned int rate;
+    unsigned int burst;
+    unsigned short int rate_latest;
     const char *addr;
     const char *body_prefix;
     const char *body_suffix;
     const char *line_delimiter;
+    // Persistent message store file and its data size in MB
+    const char *store_file;
+    unsigned int store_size;
+    // Named input channel, -i name=path
+    const char *name;
+    const char *path;
+    struct ph_config_ *channels;
+    unsigned int channels_count;
 } ph_config_t;
 
+// Reads a field /config may change while other threads serve, it is stored
+// atomically by config_set_key()
+#define config_get(c, field) __atomic_load_n(&(c)->field, __ATOMIC_RELAXED)
+
 void config_parse_opts(int argc, char **argv, ph_config_t *config);
 int config_set_key(ph_config_t *config, const char *key, const void *val);
+unsigned long int config_parse_bytes(const char *arg);
+unsigned int config_parse_rate(const char *arg);
 void config_print(ph_config_t *config);
 void config_help(void);
 
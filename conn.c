@@ -0,0 +1,95 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#include "conn.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+
+static int conn_table_grow(ph_conn_table_t *table, unsigned int min_size) {
+    unsigned int size = table->size ? table->size : PH_CONN_TABLE_MIN;
+    ph_conn_t **conns;
+
+    while (size < min_size) size *= 2;
+
+    debug_print("Connection table grow: %u slots\n", size);
+
+    if (!(conns = (ph_conn_t **)realloc(table->conns,
+                                        size * sizeof(ph_conn_t *)))) {
+        fprintf(stderr, "Cannot grow connection table\n");
+        return -1;
+    }
+    memset(conns + table->size, 0, (size - table->size) * sizeof(ph_conn_t *));
+
+    table->conns = conns;
+    table->size = size;
+
+    return 0;
+}
+
+int conn_table_init(ph_conn_table_t *table) {
+    memset(table, 0, sizeof(ph_conn_table_t));
+    return conn_table_grow(table, PH_CONN_TABLE_MIN);
+}
+
+void conn_table_free(ph_conn_table_t *table) {
+    unsigned int i;
+
+    for (i = 0; i < table->size; i++) {
+        if (table->conns[i]) {
+            free(table->conns[i]->in);
+            outq_free(&table->conns[i]->out);
+        }
+        free(table->conns[i]);
+    }
+    free(table->conns);
+    memset(table, 0, sizeof(ph_conn_table_t));
+}
+
+ph_conn_t *conn_add(ph_conn_table_t *table, int fd, int type) {
+    ph_conn_t *conn;
+
+    if (fd < 0) return NULL;
+
+    if ((unsigned int)fd >= table->size && conn_table_grow(table, fd + 1) < 0) {
+        return NULL;
+    }
+
+    if (table->conns[fd]) {
+        conn_remove(table, fd);
+    }
+
+    if (!(conn = (ph_conn_t *)calloc(1, sizeof(ph_conn_t)))) {
+        fprintf(stderr, "Cannot allocate connection\n");
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->type = type;
+    timer_init(&conn->timer, conn);
+
+    table->conns[fd] = conn;
+    table->count++;
+    if (type == PH_CONN_CLIENT) table->clients++;
+
+    return conn;
+}
+
+// Only drops the connection state, closing the descriptor is up to the caller
+void conn_remove(ph_conn_table_t *table, int fd) {
+    ph_conn_t *conn = conn_get(table, fd);
+
+    if (!conn) return;
+
+    if (conn->type == PH_CONN_CLIENT) table->clients--;
+    table->count--;
+    table->conns[fd] = NULL;
+    free(conn->in);
+    outq_free(&conn->out);
+    free(conn);
+}
@@ -0,0 +1,77 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_CONN_H
+#define __PH_CONN_H
+
+#include "outq.h"
+#include "timer.h"
+
+#define PH_CONN_TABLE_MIN 64
+
+enum conn_type {
+    PH_CONN_LISTEN = 1,
+    PH_CONN_CLIENT,
+    PH_CONN_NOTIFY,
+};
+
+// Which timeout the connection timer runs for
+enum conn_deadline {
+    PH_DEADLINE_NONE = 0,
+    // Waiting for the next request
+    PH_DEADLINE_IDLE,
+    // A request started arriving and has to complete
+    PH_DEADLINE_REQUEST,
+    // Queued output has to make progress
+    PH_DEADLINE_WRITE,
+};
+
+struct ph_channel_;
+
+typedef struct ph_conn_ {
+    int fd;
+    int type;
+    // Channel an input feeds or a follower receives
+    struct ph_channel_ *channel;
+    char *in;
+    unsigned int in_len;
+    unsigned int in_size;
+    unsigned int in_scanned;
+    // Output the socket didn't take yet, requests wait until it is sent
+    ph_outq_t out;
+    // Registered for writable events
+    int want_write;
+    // Close once the output is sent
+    int closing;
+    ph_timer_t timer;
+    int deadline;
+    // Output the client had taken when the write deadline was last set
+    unsigned long int deadline_sent;
+    int follow;
+    int follow_close;
+    unsigned long int follow_dropped;
+    struct ph_conn_ *follow_prev;
+    struct ph_conn_ *follow_next;
+} ph_conn_t;
+
+// Connections are indexed by descriptor number, the kernel hands out the
+// lowest free descriptor so the table stays dense
+typedef struct ph_conn_table_ {
+    ph_conn_t **conns;
+    unsigned int size;
+    unsigned int count;
+    unsigned int clients;
+} ph_conn_table_t;
+
+int conn_table_init(ph_conn_table_t *table);
+void conn_table_free(ph_conn_table_t *table);
+ph_conn_t *conn_add(ph_conn_table_t *table, int fd, int type);
+void conn_remove(ph_conn_table_t *table, int fd);
+
+#define conn_get(table, fd) \
+    ((fd) >= 0 && (unsigned int)(fd) < (table)->size ? (table)->conns[(fd)] : NULL)
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#include "event.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+// All descriptors are registered edge-triggered, handlers must drain them
+// until EAGAIN before returning to the loop
+static unsigned int event_to_epoll(unsigned int events) {
+    unsigned int ev = EPOLLET | EPOLLRDHUP;
+
+    if (events & PH_EVENT_IN) ev |= EPOLLIN;
+    if (events & PH_EVENT_OUT) ev |= EPOLLOUT;
+
+    return ev;
+}
+
+static unsigned int event_from_epoll(unsigned int ev) {
+    unsigned int events = 0;
+
+    if (ev & EPOLLIN) events |= PH_EVENT_IN;
+    if (ev & EPOLLOUT) events |= PH_EVENT_OUT;
+    if (ev & EPOLLERR) events |= PH_EVENT_ERR;
+    if (ev & (EPOLLHUP | EPOLLRDHUP)) events |= PH_EVENT_HUP;
+
+    return events;
+}
+
+static int event_ctl(ph_event_loop_t *loop, int op, int fd,
+                     unsigned int events) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = event_to_epoll(events);
+    ev.data.fd = fd;
+
+    return epoll_ctl(loop->epfd, op, fd, &ev);
+}
+
+int event_init(ph_event_loop_t *loop, int max_events) {
+    memset(loop, 0, sizeof(ph_event_loop_t));
+
+    if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        fprintf(stderr, "Error calling epoll_create1: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (!(loop->ready = (struct epoll_event *)malloc(
+              max_events * sizeof(struct epoll_event)))) {
+        fprintf(stderr, "Cannot allocate event list\n");
+        close(loop->epfd);
+        return -1;
+    }
+    loop->max_events = max_events;
+
+    return 0;
+}
+
+void event_free(ph_event_loop_t *loop) {
+    if (loop->epfd >= 0) close(loop->epfd);
+    free(loop->ready);
+    loop->epfd = -1;
+    loop->ready = NULL;
+}
+
+int event_add(ph_event_loop_t *loop, int fd, unsigned int events) {
+    return event_ctl(loop, EPOLL_CTL_ADD, fd, events);
+}
+
+int event_mod(ph_event_loop_t *loop, int fd, unsigned int events) {
+    return event_ctl(loop, EPOLL_CTL_MOD, fd, events);
+}
+
+int event_del(ph_event_loop_t *loop, int fd) {
+    return event_ctl(loop, EPOLL_CTL_DEL, fd, 0);
+}
+
+// Fills events with up to max_events ready descriptors. Returns the number of
+// ready descriptors, 0 on timeout or -1 on error.
+int event_wait(ph_event_loop_t *loop, ph_event_t *events, int timeout) {
+    int n, i;
+
+    n = epoll_wait(loop->epfd, loop->ready, loop->max_events, timeout);
+
+    for (i = 0; i < n; i++) {
+        events[i].fd = loop->ready[i].data.fd;
+        events[i].events = event_from_epoll(loop->ready[i].events);
+    }
+
+    return n;
+}
@@ -0,0 +1,35 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_EVENT_H
+#define __PH_EVENT_H
+
+#define PH_EVENT_IN 0x01
+#define PH_EVENT_OUT 0x02
+#define PH_EVENT_ERR 0x04
+#define PH_EVENT_HUP 0x08
+
+struct epoll_event;
+
+typedef struct ph_event_ {
+    int fd;
+    unsigned int events;
+} ph_event_t;
+
+typedef struct ph_event_loop_ {
+    int epfd;
+    int max_events;
+    struct epoll_event *ready;
+} ph_event_loop_t;
+
+int event_init(ph_event_loop_t *loop, int max_events);
+void event_free(ph_event_loop_t *loop);
+int event_add(ph_event_loop_t *loop, int fd, unsigned int events);
+int event_mod(ph_event_loop_t *loop, int fd, unsigned int events);
+int event_del(ph_event_loop_t *loop, int fd);
+int event_wait(ph_event_loop_t *loop, ph_event_t *events, int timeout);
+
+#endif
@@ -0,0 +1,312 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#include "follow.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "buf.h"
+#include "debug.h"
+#include "http.h"
+#include "messages.h"
+
+// Servers that may have followers, written only while no ingest is running
+static ph_server_t *follow_servers[PH_FOLLOW_MAX_SERVERS];
+
+void follow_register(ph_server_t *server) {
+    int i;
+
+    for (i = 0; i < PH_FOLLOW_MAX_SERVERS; i++) {
+        if (!follow_servers[i]) {
+            __atomic_store_n(&follow_servers[i], server, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+void follow_unregister(ph_server_t *server) {
+    int i;
+
+    for (i = 0; i < PH_FOLLOW_MAX_SERVERS; i++) {
+        if (follow_servers[i] == server) {
+            __atomic_store_n(&follow_servers[i], NULL, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+static ph_buf_t *follow_chunk(const char *data, unsigned int len) {
+    char head[16];
+    int head_len = snprintf(head, sizeof(head), "%x\r\n", len);
+    ph_buf_t *buf = buf_new(head_len + len + 2);
+
+    if (!buf) return NULL;
+
+    memcpy(buf->data, head, head_len);
+    memcpy(buf->data + head_len, data, len);
+    memcpy(buf->data + head_len + len, "\r\n", 2);
+
+    return buf;
+}
+
+// Every line of the message becomes a data field of one event, the event id
+// is the message sequence number
+static ph_buf_t *follow_event(uint64_t seq, const char *data,
+                              unsigned int len) {
+    const char *p, *end = data + len, *eol;
+    unsigned long int size = 1, seek;
+    char id[32];
+    ph_buf_t *buf;
+
+    seek = snprintf(id, sizeof(id), "id: %llu\n", (unsigned long long)seq);
+    size += seek;
+    for (p = data; p < end; p = eol + 1) {
+        if (!(eol = memchr(p, '\n', end - p))) eol = end;
+        size += 6 + (eol - p) + 1;
+    }
+
+    if (!(buf = buf_new(size))) return NULL;
+
+    memcpy(buf->data, id, seek);
+    for (p = data; p < end; p = eol + 1) {
+        if (!(eol = memchr(p, '\n', end - p))) eol = end;
+        memcpy(buf->data + seek, "data: ", 6);
+        seek += 6;
+        memcpy(buf->data + seek, p, eol - p);
+        seek += eol - p;
+        buf->data[seek++] = '\n';
+    }
+    buf->data[seek++] = '\n';
+
+    return buf;
+}
+
+static ph_buf_t *follow_copy(const char *data, unsigned long int len) {
+    ph_buf_t *buf = buf_new(len);
+
+    if (buf) memcpy(buf->data, data, len);
+
+    return buf;
+}
+
+static ph_buf_t *follow_string(const char *str) {
+    return follow_copy(str, strlen(str));
+}
+
+static ph_buf_t *follow_message(int format, uint64_t seq, const char *data,
+                                unsigned int len) {
+    switch (format) {
+        case PH_FOLLOW_CHUNKED:
+            return follow_chunk(data, len);
+        case PH_FOLLOW_SSE:
+            return follow_event(seq, data, len);
+        default:
+            return follow_copy(data, len);
+    }
+}
+
+static void follow_flush(ph_server_t *server, ph_conn_t *conn) {
+    if (outq_send(&conn->out, conn->fd) < 0) {
+        server_close(server, conn);
+        return;
+    }
+    server_deadline(server, conn);
+}
+
+// Turns conn into a follower, from now on it only receives new messages.
+// Only SSE can tell a client messages were dropped, slow followers of the
+// other formats are always closed.
+int follow_start(ph_server_t *server, ph_conn_t *conn, ph_channel_t *channel,
+                 int format, int close_slow, int version) {
+    ph_server_follow_t *f = &server->follow[channel->id];
+    char header[256];
+    ph_buf_t *buf;
+
+    http_header_follow(header, sizeof(header), format == PH_FOLLOW_SSE,
+                       version);
+    if (!(buf = follow_string(header))) return -1;
+
+    outq_push(&conn->out, buf);
+    buf_unref(buf);
+
+    if (!f->followers) {
+        f->seq = messages_last_seq(&channel->messages);
+    }
+
+    conn->channel = channel;
+    conn->follow = format;
+    conn->follow_close = close_slow || format != PH_FOLLOW_SSE;
+    conn->follow_prev = NULL;
+    conn->follow_next = f->followers;
+    if (f->followers) f->followers->follow_prev = conn;
+    f->followers = conn;
+    __atomic_add_fetch(&server->followers_count, 1, __ATOMIC_RELAXED);
+
+    // Edge triggered, a writable event only comes after the socket was full
+    event_mod(&server->loop, conn->fd, PH_EVENT_IN | PH_EVENT_OUT);
+    conn->want_write = 1;
+
+    debug_print("Follower %d started, format %d\n", conn->fd, format);
+
+    return 0;
+}
+
+void follow_stop(ph_server_t *server, ph_conn_t *conn) {
+    if (conn->follow == PH_FOLLOW_NONE) return;
+
+    if (conn->follow_prev) {
+        conn->follow_prev->follow_next = conn->follow_next;
+    } else {
+        server->follow[conn->channel->id].followers = conn->follow_next;
+    }
+    if (conn->follow_next) conn->follow_next->follow_prev = conn->follow_prev;
+
+    conn->follow = PH_FOLLOW_NONE;
+    __atomic_sub_fetch(&server->followers_count, 1, __ATOMIC_RELAXED);
+}
+
+static void follow_free_bufs(ph_buf_t **bufs[], unsigned int count) {
+    unsigned int format, i;
+
+    for (format = 0; format < PH_FOLLOW_FORMATS; format++) {
+        if (!bufs[format]) continue;
+        for (i = 0; i < count; i++) buf_unref(bufs[format][i]);
+        free(bufs[format]);
+        bufs[format] = NULL;
+    }
+}
+
+// Copies messages newer than the channel cursor once per format and queues
+// the shared copies on every follower of the channel
+static void follow_dispatch_channel(ph_server_t *server,
+                                    ph_channel_t *channel) {
+    ph_server_follow_t *f = &server->follow[channel->id];
+    ph_buf_t **bufs[PH_FOLLOW_FORMATS] = {NULL};
+    int used[PH_FOLLOW_FORMATS] = {0};
+    ph_conn_t *conn, *next;
+    ph_ring_view_t view;
+    ph_ring_entry_t e;
+    unsigned int count = 0, format, i;
+    uint64_t from, s, missed;
+
+    if (!f->followers || messages_last_seq(&channel->messages) <= f->seq) {
+        return;
+    }
+
+    for (conn = f->followers; conn; conn = conn->follow_next) {
+        used[conn->follow] = 1;
+    }
+
+    do {
+        messages_read_begin(&channel->messages, &view);
+        from = f->seq + 1;
+        if (from < view.first) from = view.first;
+        count = view.last >= from ? view.last - from + 1 : 0;
+
+        for (format = 0; format < PH_FOLLOW_FORMATS; format++) {
+            if (used[format] &&
+                !(bufs[format] =
+                      (ph_buf_t **)calloc(count + 1, sizeof(ph_buf_t *)))) {
+                messages_read_end(&channel->messages, &view, from);
+                follow_free_bufs(bufs, count);
+                fprintf(stderr, "Cannot allocate follow buffers\n");
+                return;
+            }
+        }
+
+        for (s = from, i = 0; i < count; s++, i++) {
+            const char *data = ring_view_entry(&view, s, &e);
+            if (!data) continue;
+            for (format = 0; format < PH_FOLLOW_FORMATS; format++) {
+                if (bufs[format])
+                    bufs[format][i] = follow_message(format, s, data, e.len);
+            }
+        }
+
+        if (messages_read_end(&channel->messages, &view, from) == 0) break;
+
+        follow_free_bufs(bufs, count);
+    } while (1);
+
+    // Messages evicted before they could be dispatched are lost to all
+    missed = from - f->seq - 1;
+    f->seq = view.last;
+
+    for (conn = f->followers; conn; conn = next) {
+        ph_buf_t **queue = bufs[conn->follow];
+        next = conn->follow_next;
+
+        conn->follow_dropped += missed;
+
+        for (i = 0; i < count; i++) {
+            if (!queue[i]) continue;
+
+            if (outq_bytes(&conn->out) > PH_FOLLOW_MAX_QUEUE) {
+                conn->follow_dropped++;
+                continue;
+            }
+
+            if (conn->follow_dropped && conn->follow == PH_FOLLOW_SSE) {
+                char comment[64];
+                ph_buf_t *buf;
+
+                snprintf(comment, sizeof(comment), ": dropped %lu\n\n",
+                         conn->follow_dropped);
+                if ((buf = follow_string(comment))) {
+                    outq_push(&conn->out, buf);
+                    buf_unref(buf);
+                }
+                conn->follow_dropped = 0;
+            }
+            outq_push(&conn->out, queue[i]);
+        }
+
+        if (conn->follow_dropped && conn->follow_close) {
+            debug_print("Follower %d too slow, closing\n", conn->fd);
+            server_close(server, conn);
+            continue;
+        }
+
+        follow_flush(server, conn);
+    }
+
+    follow_free_bufs(bufs, count);
+}
+
+void follow_dispatch(ph_server_t *server) {
+    unsigned int i;
+
+    for (i = 0; i < channels_count(); i++) {
+        follow_dispatch_channel(server, channel_get(i));
+    }
+}
+
+// Called by the writer server after it stored messages, from ingest_drain()
+// or a held back one. The ingest thread only reads, it never stores or calls
+// this. Followers on the writer are served right away, other servers are
+// woken at most once until they caught up.
+void follow_notify(ph_server_t *self) {
+    int i;
+
+    for (i = 0; i < PH_FOLLOW_MAX_SERVERS; i++) {
+        ph_server_t *server =
+            __atomic_load_n(&follow_servers[i], __ATOMIC_ACQUIRE);
+
+        if (!server ||
+            __atomic_load_n(&server->followers_count, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+
+        if (server == self) {
+            follow_dispatch(server);
+        } else if (!__atomic_exchange_n(&server->follow_pending, 1,
+                                        __ATOMIC_ACQ_REL)) {
+            server_notify(server);
+        }
+    }
+}
@@ -0,0 +1,35 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_FOLLOW_H
+#define __PH_FOLLOW_H
+
+#include "channel.h"
+#include "conn.h"
+#include "server.h"
+
+// Queued bytes above which a follower counts as slow
+#define PH_FOLLOW_MAX_QUEUE (1024 * 1024)
+#define PH_FOLLOW_MAX_SERVERS 257
+
+enum follow_format {
+    PH_FOLLOW_NONE = 0,
+    PH_FOLLOW_CHUNKED,
+    PH_FOLLOW_SSE,
+    // HTTP/1.0 clients get the message bytes as they are until the close
+    PH_FOLLOW_RAW,
+    PH_FOLLOW_FORMATS
+};
+
+void follow_register(ph_server_t *server);
+void follow_unregister(ph_server_t *server);
+int follow_start(ph_server_t *server, ph_conn_t *conn, ph_channel_t *channel,
+                 int format, int close_slow, int version);
+void follow_stop(ph_server_t *server, ph_conn_t *conn);
+void follow_dispatch(ph_server_t *server);
+void follow_notify(ph_server_t *self);
+
+#endif
@@ -0,0 +1,387 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#include "gzip.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef PH_ZLIB
+#include <zlib.h>
+#endif
+
+#include "debug.h"
+
+const char *gzip_encoding_name(int encoding) {
+    switch (encoding) {
+        case PH_ENCODING_GZIP:
+            return "gzip";
+        case PH_ENCODING_DEFLATE:
+            return "deflate";
+    }
+    return "identity";
+}
+
+#ifdef PH_ZLIB
+
+char *gzip_compress(const char *data, unsigned long int len, int encoding,
+                    unsigned long int *out_len) {
+    z_stream strm;
+    char *out;
+    // 31 adds the gzip wrapper, 15 the zlib one
+    int bits = encoding == PH_ENCODING_GZIP ? 31 : 15;
+
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, bits, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    *out_len = deflateBound(&strm, len);
+    if (!(out = (char *)malloc(*out_len))) {
+        fprintf(stderr, "Cannot alloc memory for compressed body\n");
+        deflateEnd(&strm);
+        return NULL;
+    }
+
+    strm.next_in = (Bytef *)data;
+    strm.avail_in = len;
+    strm.next_out = (Bytef *)out;
+    strm.avail_out = *out_len;
+
+    if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&strm);
+        free(out);
+        return NULL;
+    }
+    *out_len = strm.total_out;
+    deflateEnd(&strm);
+
+    return out;
+}
+
+#else
+
+// Single fixed Huffman block (RFC 1951 3.2.6) with greedy LZ77 matching
+// over hash chains. Less compact than zlib but text logs still shrink a lot
+// and there is no dependency.
+
+#define GZIP_MIN_MATCH 3
+#define GZIP_MAX_MATCH 258
+// Short matches that far back cost more bits than the literals
+#define GZIP_TOO_FAR 4096
+
+static const uint16_t length_base[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                         1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                         4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t dist_base[30] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t dist_extra[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                       4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                       9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Codes already bit reversed, deflate sends Huffman codes MSB first
+static uint16_t lit_code[288];
+static uint8_t lit_bits[288];
+static uint8_t dist_code_bits[30];
+static uint8_t length_code[GZIP_MAX_MATCH + 1];
+// Distance code for d - 1 < 256 and for (d - 1) >> 7 above
+static uint8_t dist_code[512];
+static uint32_t crc_table[256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+typedef struct gzip_bits_ {
+    unsigned char *out;
+    unsigned long int pos;
+    uint64_t bits;
+    unsigned int count;
+} gzip_bits_t;
+
+static unsigned int gzip_reverse(unsigned int code, unsigned int bits) {
+    unsigned int r = 0;
+
+    while (bits--) {
+        r = (r << 1) | (code & 1);
+        code >>= 1;
+    }
+    return r;
+}
+
+static void gzip_tables_init(void) {
+    unsigned int i, c, k;
+
+    for (i = 0; i < 288; i++) {
+        if (i < 144) {
+            c = 0x30 + i;
+            lit_bits[i] = 8;
+        } else if (i < 256) {
+            c = 0x190 + i - 144;
+            lit_bits[i] = 9;
+        } else if (i < 280) {
+            c = i - 256;
+            lit_bits[i] = 7;
+        } else {
+            c = 0xc0 + i - 280;
+            lit_bits[i] = 8;
+        }
+        lit_code[i] = gzip_reverse(c, lit_bits[i]);
+    }
+
+    for (i = 0; i < 30; i++) {
+        dist_code_bits[i] = gzip_reverse(i, 5);
+    }
+
+    for (c = 0; c < 29; c++) {
+        for (i = length_base[c];
+             i < length_base[c] + (1U << length_extra[c]) && i <= 258; i++) {
+            length_code[i] = c;
+        }
+    }
+    // 258 has a code of its own
+    length_code[258] = 28;
+
+    for (c = 0; c < 30; c++) {
+        for (i = dist_base[c] - 1; i < dist_base[c] - 1 + (1U << dist_extra[c]);
+             i++) {
+            if (i < 256) {
+                dist_code[i] = c;
+            } else {
+                dist_code[256 + (i >> 7)] = c;
+            }
+        }
+    }
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static inline void gzip_put(gzip_bits_t *w, uint32_t value, unsigned int n) {
+    w->bits |= (uint64_t)value << w->count;
+    w->count += n;
+    if (w->count >= 32) {
+        w->out[w->pos++] = w->bits;
+        w->out[w->pos++] = w->bits >> 8;
+        w->out[w->pos++] = w->bits >> 16;
+        w->out[w->pos++] = w->bits >> 24;
+        w->bits >>= 32;
+        w->count -= 32;
+    }
+}
+
+static void gzip_flush(gzip_bits_t *w) {
+    while (w->count > 0) {
+        w->out[w->pos++] = w->bits;
+        w->bits >>= 8;
+        w->count = w->count > 8 ? w->count - 8 : 0;
+    }
+}
+
+static inline void gzip_literal(gzip_bits_t *w, unsigned char c) {
+    gzip_put(w, lit_code[c], lit_bits[c]);
+}
+
+static inline void gzip_match(gzip_bits_t *w, unsigned int len,
+                              unsigned int dist) {
+    unsigned int lc = length_code[len];
+    unsigned int dc = dist - 1 < 256 ? dist_code[dist - 1]
+                                     : dist_code[256 + ((dist - 1) >> 7)];
+
+    gzip_put(w, lit_code[257 + lc], lit_bits[257 + lc]);
+    if (length_extra[lc]) gzip_put(w, len - length_base[lc], length_extra[lc]);
+    gzip_put(w, dist_code_bits[dc], 5);
+    if (dist_extra[dc]) gzip_put(w, dist - dist_base[dc], dist_extra[dc]);
+}
+
+static inline uint32_t gzip_hash(const unsigned char *p) {
+    uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+
+    return (v * 2654435761U) >> (32 - PH_GZIP_HASH_BITS);
+}
+
+static inline unsigned int gzip_match_length(const unsigned char *a,
+                                             const unsigned char *b,
+                                             unsigned int max) {
+    unsigned int n = 0;
+
+    while (n + 8 <= max) {
+        uint64_t x, y;
+
+        memcpy(&x, a + n, 8);
+        memcpy(&y, b + n, 8);
+        if (x != y) return n + (__builtin_ctzll(x ^ y) >> 3);
+        n += 8;
+    }
+    while (n < max && a[n] == b[n]) n++;
+
+    return n;
+}
+
+static void gzip_deflate(gzip_bits_t *w, const unsigned char *data,
+                         unsigned long int len, int32_t *head,
+                         int32_t *prev) {
+    unsigned long int i = 0, k;
+
+    // Final block, fixed Huffman codes
+    gzip_put(w, 1, 1);
+    gzip_put(w, 1, 2);
+
+    while (i < len) {
+        unsigned int best_len = 0, best_dist = 0;
+
+        if (i + GZIP_MIN_MATCH <= len) {
+            unsigned int max = len - i < GZIP_MAX_MATCH ? len - i
+                                                        : GZIP_MAX_MATCH;
+            uint32_t h = gzip_hash(data + i);
+            int32_t cand = head[h];
+            int chain = PH_GZIP_MAX_CHAIN;
+
+            while (cand >= 0 && i - cand <= PH_GZIP_WINDOW && chain--) {
+                if (data[cand + best_len] == data[i + best_len]) {
+                    unsigned int l = gzip_match_length(data + cand, data + i,
+                                                       max);
+                    if (l > best_len) {
+                        best_len = l;
+                        best_dist = i - cand;
+                        if (l == max) break;
+                    }
+                }
+                cand = prev[cand & (PH_GZIP_WINDOW - 1)];
+            }
+            prev[i & (PH_GZIP_WINDOW - 1)] = head[h];
+            head[h] = i;
+        }
+
+        if (best_len > GZIP_MIN_MATCH ||
+            (best_len == GZIP_MIN_MATCH && best_dist <= GZIP_TOO_FAR)) {
+            gzip_match(w, best_len, best_dist);
+            for (k = i + 1; k < i + best_len && k + GZIP_MIN_MATCH <= len;
+                 k++) {
+                uint32_t h = gzip_hash(data + k);
+
+                prev[k & (PH_GZIP_WINDOW - 1)] = head[h];
+                head[h] = k;
+            }
+            i += best_len;
+        } else {
+            gzip_literal(w, data[i]);
+            i++;
+        }
+    }
+
+    // End of block
+    gzip_put(w, lit_code[256], lit_bits[256]);
+    gzip_flush(w);
+}
+
+static uint32_t gzip_crc32(const unsigned char *data, unsigned long int len) {
+    uint32_t crc = 0xffffffff;
+
+    while (len--) crc = crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+    return crc ^ 0xffffffff;
+}
+
+static uint32_t gzip_adler32(const unsigned char *data,
+                             unsigned long int len) {
+    uint32_t a = 1, b = 0;
+    unsigned long int n;
+
+    while (len > 0) {
+        // Largest run that can't overflow before the modulo
+        n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n--) {
+            a += *data++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+static void gzip_put32le(unsigned char *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// Returns the data compressed as a gzip or zlib stream in a new buffer
+char *gzip_compress(const char *data, unsigned long int len, int encoding,
+                    unsigned long int *out_len) {
+    const unsigned char *in = (const unsigned char *)data;
+    // Worst case is a 3 byte match costing 31 bits
+    unsigned long int size = len + len / 2 + 64;
+    gzip_bits_t w = {0};
+    int32_t *head, *prev;
+    char *out;
+
+    pthread_once(&tables_once, gzip_tables_init);
+
+    head = (int32_t *)malloc((1 << PH_GZIP_HASH_BITS) * sizeof(int32_t));
+    prev = (int32_t *)malloc(PH_GZIP_WINDOW * sizeof(int32_t));
+    w.out = (unsigned char *)malloc(size);
+    if (!head || !prev || !w.out) {
+        fprintf(stderr, "Cannot alloc memory for compressed body\n");
+        free(head);
+        free(prev);
+        free(w.out);
+        return NULL;
+    }
+    memset(head, 0xff, (1 << PH_GZIP_HASH_BITS) * sizeof(int32_t));
+
+    if (encoding == PH_ENCODING_GZIP) {
+        static const unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0,
+                                                 0,    0,    0, 0, 3};
+        memcpy(w.out, header, sizeof(header));
+        w.pos = sizeof(header);
+    } else {
+        // Deflate with a 32K window, fastest level
+        w.out[w.pos++] = 0x78;
+        w.out[w.pos++] = 0x01;
+    }
+
+    gzip_deflate(&w, in, len, head, prev);
+
+    if (encoding == PH_ENCODING_GZIP) {
+        gzip_put32le(w.out + w.pos, gzip_crc32(in, len));
+        gzip_put32le(w.out + w.pos + 4, len);
+        w.pos += 8;
+    } else {
+        uint32_t adler = gzip_adler32(in, len);
+
+        w.out[w.pos++] = adler >> 24;
+        w.out[w.pos++] = adler >> 16;
+        w.out[w.pos++] = adler >> 8;
+        w.out[w.pos++] = adler;
+    }
+
+    free(head);
+    free(prev);
+
+    debug_print("Compressed %lu bytes to %lu\n", len, w.pos);
+
+    *out_len = w.pos;
+    if (!(out = realloc(w.out, w.pos))) out = (char *)w.out;
+
+    return out;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,26 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_GZIP_H
+#define __PH_GZIP_H
+
+// Window and match search limits of the built in encoder
+#define PH_GZIP_WINDOW 32768
+#define PH_GZIP_HASH_BITS 15
+#define PH_GZIP_MAX_CHAIN 16
+
+// HTTP content codings, deflate is the zlib format
+enum gzip_encoding {
+    PH_ENCODING_IDENTITY = 0,
+    PH_ENCODING_GZIP,
+    PH_ENCODING_DEFLATE,
+};
+
+char *gzip_compress(const char *data, unsigned long int len, int encoding,
+                    unsigned long int *out_len);
+const char *gzip_encoding_name(int encoding);
+
+#endif
\ No newline at end of file
@@ -4,6 +4,7 @@
  *    The MIT License (MIT)
  *
  */
+#define _GNU_SOURCE
 #include "http.h"
 
 #include <errno.h>
@@ -11,9 +12,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 
+#include "cache.h"
 #include "config.h"
 #include "debug.h"
+#include "messages.h"
 
 static long int *http_get_number(char *str) {
     long int *lines = NULL;
@@ -33,34 +38,384 @@ static long int *http_get_number(char *str) {
     return lines;
 }
 
-int http_parse_request(char *req, void **result) {
-    char http_path[256];
-    int http_ver;
+static uint64_t *http_get_seq(const char *str) {
+    uint64_t *seq;
+    char *end;
 
-    int res = sscanf(req, "GET %255s HTTP/1.%1d\n", http_path, &http_ver);
-    if (res != 2) {
-        debug_print("%s", "Error parsing http get\n");
+    if (*str < '0' || *str > '9') return NULL;
+    if (!(seq = malloc(sizeof(uint64_t)))) return NULL;
+
+    errno = 0;
+    *seq = strtoull(str, &end, 10);
+    if (errno == ERANGE || (*end != '\0' && *end != '?')) {
+        free(seq);
+        return NULL;
+    }
+
+    return seq;
+}
+
+// Finds the empty line ending the request head starting the search at
+// *scanned. Returns the head length including the empty line, 0 if the head
+// isn't complete yet.
+static unsigned int http_head_length(const char *buf, unsigned int len,
+                                     unsigned int *scanned) {
+    const char *p = buf + *scanned;
+    const char *end = buf + len;
+
+    while (p < end && (p = memchr(p, '\n', end - p))) {
+        p++;
+        if (p < end && *p == '\n') return p + 1 - buf;
+        if (p + 1 < end && p[0] == '\r' && p[1] == '\n') return p + 2 - buf;
+        if (p + 1 >= end) break;
+    }
+
+    // Resume from the last line start, it may still become the empty line
+    *scanned = len > 2 ? len - 2 : 0;
+    return 0;
+}
+
+static int http_token_has(const char *value, unsigned int len,
+                          const char *token) {
+    unsigned int token_len = strlen(token);
+    unsigned int i;
+
+    for (i = 0; i + token_len <= len; i++) {
+        if (strncasecmp(value + i, token, token_len) == 0) return 1;
+    }
+    return 0;
+}
+
+// Whether coding is listed in an Accept-Encoding value without q=0
+static int http_encoding_accepted(const char *value, unsigned int len,
+                                  const char *coding) {
+    unsigned int coding_len = strlen(coding);
+    const char *p = value, *end = value + len, *next, *q;
+
+    for (; p < end; p = next + 1) {
+        next = memchr(p, ',', end - p);
+        if (!next) next = end;
+        while (p < next && (*p == ' ' || *p == '\t')) p++;
+        if (next - p < coding_len || strncasecmp(p, coding, coding_len) != 0)
+            continue;
+        q = p + coding_len;
+        while (q < next && (*q == ' ' || *q == '\t')) q++;
+        if (q == next) return 1;
+        if (*q != ';') continue;
+        // q=0 means not acceptable, any other weight is fine
+        q = memchr(q, '=', next - q);
+        if (!q) return 1;
+        for (q++; q < next && (*q == '0' || *q == '.' || *q == ' '); q++)
+            ;
+        return q < next;
+    }
+    return 0;
+}
+
+// Single byte ranges only, anything else is ignored and the full body sent
+static void http_parse_range(ph_http_range_t *range, const char *value,
+                             unsigned int len) {
+    char spec[64];
+    char *p, *end;
+
+    if (len < 6 || len >= sizeof(spec) || strncasecmp(value, "bytes=", 6))
+        return;
+    memcpy(spec, value + 6, len - 6);
+    spec[len - 6] = '\0';
+    if (strchr(spec, ',')) return;
+
+    p = spec;
+    while (*p == ' ') p++;
+    errno = 0;
+    if (*p == '-') {
+        if (p[1] < '0' || p[1] > '9') return;
+        range->end = strtoull(p + 1, &end, 10);
+        range->suffix = 1;
+    } else {
+        if (*p < '0' || *p > '9') return;
+        range->start = strtoull(p, &end, 10);
+        if (*end++ != '-') return;
+        if (*end >= '0' && *end <= '9') {
+            range->end = strtoull(end, &end, 10);
+            if (range->end < range->start) return;
+        } else {
+            range->end = UINT64_MAX;
+        }
+    }
+    while (*end == ' ') end++;
+    if (*end != '\0' || errno == ERANGE) return;
+
+    range->set = 1;
+}
+
+#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT"
+
+// IMF-fixdate only, as sent back from our own Last-Modified. 0 if invalid.
+static time_t http_parse_date(const char *value, unsigned int len) {
+    char date[64];
+    struct tm tm;
+    char *end;
+
+    if (len >= sizeof(date)) return 0;
+    memcpy(date, value, len);
+    date[len] = '\0';
+
+    memset(&tm, 0, sizeof(tm));
+    if (!(end = strptime(date, HTTP_DATE_FORMAT, &tm)) || *end != '\0')
+        return 0;
+
+    return timegm(&tm);
+}
+
+static void http_parse_header(ph_http_request_t *req, const char *line,
+                              unsigned int len) {
+    const char *colon = memchr(line, ':', len);
+    const char *value;
+    unsigned int name_len, value_len;
+
+    if (!colon) return;
+
+    name_len = colon - line;
+    value = colon + 1;
+    while (value < line + len && (*value == ' ' || *value == '\t')) value++;
+    value_len = line + len - value;
+
+    if (name_len == 10 && strncasecmp(line, "Connection", 10) == 0) {
+        if (http_token_has(value, value_len, "close")) {
+            req->keep_alive = 0;
+        } else if (http_token_has(value, value_len, "keep-alive")) {
+            req->keep_alive = 1;
+        }
+    } else if (name_len == 6 && strncasecmp(line, "Accept", 6) == 0) {
+        req->event_stream =
+            http_token_has(value, value_len, "text/event-stream");
+    } else if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+        req->content_length = strtoul(value, NULL, 10);
+    } else if (name_len == 15 &&
+               strncasecmp(line, "Accept-Encoding", 15) == 0) {
+        if (http_encoding_accepted(value, value_len, "gzip")) {
+            req->encoding = PH_ENCODING_GZIP;
+        } else if (http_encoding_accepted(value, value_len, "deflate")) {
+            req->encoding = PH_ENCODING_DEFLATE;
+        }
+    } else if (name_len == 5 && strncasecmp(line, "Range", 5) == 0) {
+        http_parse_range(&req->range, value, value_len);
+    } else if (name_len == 13 && strncasecmp(line, "If-None-Match", 13) == 0) {
+        if (value_len < sizeof(req->if_none_match)) {
+            memcpy(req->if_none_match, value, value_len);
+            req->if_none_match[value_len] = '\0';
+        }
+    } else if (name_len == 17 &&
+               strncasecmp(line, "If-Modified-Since", 17) == 0) {
+        req->if_modified_since = http_parse_date(value, value_len);
+    } else if (name_len == 8 && strncasecmp(line, "If-Range", 8) == 0) {
+        // Too long to be one of ours, it never matches
+        if (value_len < sizeof(req->if_range)) {
+            memcpy(req->if_range, value, value_len);
+            req->if_range[value_len] = '\0';
+        } else {
+            strcpy(req->if_range, "W/");
+        }
+    }
+}
+
+// Parses one request from the start of buf. Returns the number of bytes it
+// takes, 0 when more data is needed or PH_HTTP_ERROR if it is malformed.
+// scanned keeps the search position between calls on a growing buffer and
+// must be reset when the request is consumed.
+int http_parse(const char *buf, unsigned int len, unsigned int *scanned,
+               ph_http_request_t *req) {
+    char line[PH_HTTP_MAX_PATH + 32];
+    unsigned int head_len, line_len;
+    const char *p, *end, *eol;
+
+    if (!(head_len = http_head_length(buf, len, scanned))) {
+        return len >= PH_HTTP_MAX_REQUEST ? PH_HTTP_ERROR : 0;
+    }
+
+    memset(req, 0, sizeof(ph_http_request_t));
+
+    eol = memchr(buf, '\n', head_len);
+    line_len = eol - buf;
+    if (line_len >= sizeof(line)) {
+        debug_print("%s", "Request line too long\n");
+        return PH_HTTP_ERROR;
+    }
+    memcpy(line, buf, line_len);
+    line[line_len] = '\0';
+
+    if (sscanf(line, "%7s %255s HTTP/1.%1d", req->method, req->path,
+               &req->version) != 3) {
+        debug_print("%s", "Error parsing http request line\n");
         return PH_HTTP_ERROR;
     }
+    // Persistent connections are the default from HTTP/1.1 on
+    req->keep_alive = req->version >= 1;
+
+    end = buf + head_len;
+    for (p = eol + 1; p < end; p = eol + 1) {
+        eol = memchr(p, '\n', end - p);
+        line_len = eol - p;
+        if (line_len > 0 && p[line_len - 1] == '\r') line_len--;
+        if (line_len == 0) break;
+        http_parse_header(req, p, line_len);
+    }
+
+    if (req->content_length > PH_HTTP_MAX_REQUEST) return PH_HTTP_ERROR;
+    if (len - head_len < req->content_length) return 0;
+
+    return head_len + req->content_length;
+}
 
-    if (strncmp(http_path, "/", sizeof(http_path)) == 0) {
+// Moves the channel name of a /ch/<name>/... path to name and leaves the rest
+// of the path in req. Returns 1 if there was one, 0 if not and PH_HTTP_ERROR
+// for a malformed or too long name.
+int http_request_channel(ph_http_request_t *req, char *name,
+                         unsigned int size) {
+    char *start, *end;
+    unsigned int len;
+
+    if (strncmp(req->path, "/ch/", 4) != 0) return 0;
+
+    start = req->path + 4;
+    end = start + strcspn(start, "/");
+    len = end - start;
+    if (len == 0 || len >= size) return PH_HTTP_ERROR;
+
+    memcpy(name, start, len);
+    name[len] = '\0';
+
+    if (*end == '\0') {
+        strcpy(req->path, "/");
+    } else {
+        memmove(req->path, end, strlen(end) + 1);
+    }
+
+    return 1;
+}
+
+int http_parse_request(const ph_http_request_t *req, void **result) {
+    const char *http_path = req->path;
+
+    if (strcmp(req->method, "GET") != 0) {
+        debug_print("Unsupported method %s\n", req->method);
+        return PH_HTTP_ERROR;
+    }
+
+    if (http_path[0] == '/' && (http_path[1] == '\0' || http_path[1] == '?')) {
         return PH_HTTP_LINES;
-    } else if (strncmp(http_path, "/clear", sizeof(http_path)) == 0) {
+    } else if (strcmp(http_path, "/clear") == 0) {
         return PH_HTTP_CLEAR;
+    } else if (strncmp(http_path, "/follow", 7) == 0 &&
+               (http_path[7] == '\0' || http_path[7] == '?')) {
+        *result = strdup(http_path);
+        return PH_HTTP_FOLLOW;
+    } else if (strncmp(http_path, "/stats", 6) == 0 &&
+               (http_path[6] == '\0' || http_path[6] == '?')) {
+        *result = strdup(http_path);
+        return PH_HTTP_STATS;
+    } else if (strncmp(http_path, "/grep?", 6) == 0) {
+        *result = strdup(http_path);
+        return PH_HTTP_GREP;
+    } else if (strncmp(http_path, "/range", 6) == 0 &&
+               (http_path[6] == '\0' || http_path[6] == '?')) {
+        *result = strdup(http_path);
+        return PH_HTTP_TIME_RANGE;
+    } else if (strncmp(http_path, "/since/", 7) == 0) {
+        if ((*result = http_get_seq(http_path + 7))) return PH_HTTP_SINCE;
     } else if (strstr(http_path, "/config")) {
         *result = strdup(http_path);
         return PH_HTTP_CONFIG;
     } else {
-        if ((*result = (void **)http_get_number(http_path + 1)))
+        if ((*result = (void **)http_get_number((char *)http_path + 1)))
             return PH_HTTP_LINES;
     }
 
     return PH_HTTP_ERROR;
 }
 
+static int http_hex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Copies the percent decoded value of query parameter key from path into
+// value. Returns the value length or -1 when the parameter is missing.
+int http_query_value(const char *path, const char *key, char *value,
+                     unsigned int size) {
+    unsigned int key_len = strlen(key);
+    const char *p = strchr(path, '?');
+    unsigned int n = 0;
+
+    if (!p || size == 0) return -1;
+
+    while (p && *p) {
+        p++;  // skip '?' or '&'
+        if (strncmp(p, key, key_len) == 0 &&
+            (p[key_len] == '=' || p[key_len] == '&' || p[key_len] == '\0')) {
+            p += key_len;
+            if (*p == '=') p++;
+            while (*p && *p != '&' && n < size - 1) {
+                if (*p == '%' && http_hex(p[1]) >= 0 && http_hex(p[2]) >= 0) {
+                    value[n++] = http_hex(p[1]) * 16 + http_hex(p[2]);
+                    p += 3;
+                } else {
+                    value[n++] = *p == '+' ? ' ' : *p;
+                    p++;
+                }
+            }
+            value[n] = '\0';
+            return n;
+        }
+        p = strchr(p, '&');
+    }
+
+    return -1;
+}
+
+// Reads query parameter key as seconds since the epoch with an optional
+// fraction into wall clock nanoseconds, negative values count back from now.
+// Returns 1 when it was read, 0 when it is missing and -1 when malformed.
+int http_query_time(const char *path, const char *key, uint64_t *ns) {
+    uint64_t sec, frac = 0, scale = 100000000ULL;
+    struct timespec now;
+    char value[32], *p = value;
+    int back, n;
+
+    if ((n = http_query_value(path, key, value, sizeof(value))) < 0) return 0;
+    if (n == 0) return -1;
+    if ((back = *p == '-')) p++;
+    if (*p < '0' || *p > '9') return -1;
+
+    errno = 0;
+    sec = strtoull(p, &p, 10);
+    if (errno == ERANGE || sec > UINT64_MAX / 1000000000ULL - 1) return -1;
+    if (*p == '.') {
+        for (p++; *p >= '0' && *p <= '9'; p++, scale /= 10) {
+            frac += (*p - '0') * scale;
+        }
+    }
+    if (*p != '\0') return -1;
+
+    *ns = sec * 1000000000ULL + frac;
+    if (back) {
+        uint64_t t;
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        t = now.tv_sec * 1000000000ULL + now.tv_nsec;
+        *ns = *ns < t ? t - *ns : 0;
+    }
+
+    return 1;
+}
+
 int http_parse_request_config(const char *path, ph_config_t *config) {
     // Format of GET /config: /config?lines=100&rate=60
-    char *known_keys[] = {"rate", "max_lines", "output_stdin", "timeout", NULL};
+    char *known_keys[] = {"rate",      "burst",     "latest",
+                          "max_lines", "max_bytes", "output_stdin",
+                          "timeout",   NULL};
 
     char *s = strchr(path, '?');
     if (!s) {
@@ -70,14 +425,23 @@ int http_parse_request_config(const char *path, ph_config_t *config) {
 
     char **known = known_keys;
     for (; *known; known++) {
-        int v = 0;
+        long int v = 0;
         char *m = strstr(s, *known);
         if (m) {
             char fmt[32];
-            snprintf(fmt, sizeof(fmt), "%s=%%d", *known);
+            snprintf(fmt, sizeof(fmt), "%s=%%ld", *known);
             int c = sscanf(m, fmt, &v);
+            // Rate is given in seconds with an optional fraction
+            if (strcmp(*known, "rate") == 0 && m[4] == '=') {
+                v = config_parse_rate(m + 5);
+                c = 1;
+            }
+            // Sizes take a K, M or G suffix like -m
+            if (strcmp(*known, "max_bytes") == 0 && c == 1) {
+                v = config_parse_bytes(m + 10);
+            }
             if (c == 1) {
-                debug_print("Key: %s Value: %d\n", *known, v);
+                debug_print("Key: %s Value: %ld\n", *known, v);
                 config_set_key(config, *known, &v);
             }
         }
@@ -86,48 +450,355 @@ int http_parse_request_config(const char *path, ph_config_t *config) {
     return 0;
 }
 
-char *http_response_error(void) { return strdup(HTTP_ERROR_RESPONSE); }
+static const char *http_connection(int keep_alive) {
+    return keep_alive ? "Connection: keep-alive" : "Connection: close";
+}
+
+char *http_response_error(int keep_alive) {
+    char *response = (char *)malloc(256);
+
+    if (!response) return NULL;
+
+    snprintf(response, 256, "%s\r\n%s\r\n%s\r\n\r\nNOT FOUND",
+             "HTTP/1.1 404 Not Found", "Content-Length: 9",
+             http_connection(keep_alive));
+
+    return response;
+}
+
+// Current settings and usage of a channel as key=value lines
+char *http_response_config(const ph_config_t *config, unsigned int lines,
+                           uint64_t bytes, uint64_t memory, int keep_alive) {
+    unsigned int rate = config_get(config, rate);
+    char body[512], *response;
+    int body_len;
+
+    body_len = snprintf(body, sizeof(body),
+                        "rate=%u.%03u\nburst=%u\nlatest=%u\n"
+                        "max_lines=%u\nmax_bytes=%lu\n"
+                        "output_stdin=%u\ntimeout=%d\n"
+                        "lines=%u\nbytes=%llu\nmemory=%llu\n",
+                        rate / 1000, rate % 1000, config_get(config, burst),
+                        config_get(config, rate_latest),
+                        config_get(config, max_lines),
+                        config_get(config, max_bytes),
+                        config_get(config, output_stdin),
+                        config_get(config, timeout), lines,
+                        (unsigned long long)bytes, (unsigned long long)memory);
+
+    if (!(response = (char *)malloc(256 + sizeof(body)))) return NULL;
+
+    snprintf(response, 256 + sizeof(body),
+             "%s\r\n%s\r\n%s%d\r\n%s\r\n\r\n%s", "HTTP/1.1 200 OK",
+             "Content-Type: text/plain", "Content-Length: ", body_len,
+             http_connection(keep_alive), body);
+
+    return response;
+}
+
+char *http_response_stats(const char *body, unsigned long int body_len,
+                          int prometheus, int keep_alive) {
+    char *response;
+
+    if (!(response = (char *)malloc(256 + body_len))) return NULL;
 
-char *http_response_ok(void) {
+    snprintf(response, 256 + body_len, "%s\r\n%s\r\n%s%lu\r\n%s\r\n\r\n%s",
+             "HTTP/1.1 200 OK",
+             prometheus ? "Content-Type: text/plain; version=0.0.4"
+                        : "Content-Type: text/plain",
+             "Content-Length: ", body_len, http_connection(keep_alive), body);
+
+    return response;
+}
+
+char *http_response_ok(int keep_alive) {
     char *response = (char *)malloc(256);
 
+    if (!response) return NULL;
+
     snprintf(response, 256, "%s\r\n%s\r\n%s\r\n%s\r\n\r\nOK", "HTTP/1.1 200 OK",
-             "Accept-Ranges: bytes", "Content-Length: 2", "Connection: close");
+             "Accept-Ranges: bytes", "Content-Length: 2",
+             http_connection(keep_alive));
 
     return response;
 }
 
-char *http_response_lines(const char *body) {
-    char header[256];
+// The messages after the cursor of a GET /since request are gone, clients can
+// resume from X-Ph-First-Seq - 1
+char *http_response_gone(const ph_ring_range_t *range, int keep_alive) {
+    char *response = (char *)malloc(256);
+
+    if (!response) return NULL;
 
-    if (!body) return NULL;
+    snprintf(response, 256,
+             "%s\r\n%s%llu\r\n%s%llu\r\n%s\r\n%s\r\n\r\nEVICTED",
+             "HTTP/1.1 410 Gone", "X-Ph-Seq: ", (unsigned long long)range->last,
+             "X-Ph-First-Seq: ", (unsigned long long)range->first,
+             "Content-Length: 7", http_connection(keep_alive));
 
-    unsigned long int header_len = 0;
-    unsigned long int response_size = 0;
-    unsigned long int body_len = strlen(body);
+    return response;
+}
 
-    snprintf(header, 256, "%s\r\n%s\r\n%s%ld\r\n%s", "HTTP/1.1 200 OK",
-             "Accept-Ranges: bytes", "Content-Length: ", body_len,
-             "Connection: close");
+// Tag of a lines response, it covers the messages in range and everything else
+// that shapes the body
+// The epoch keeps tags of a restarted store from naming older bodies
+int http_etag(char *etag, unsigned int size, uint64_t epoch,
+              const ph_ring_range_t *range,
+              const char *prefix, const char *suffix,
+              const char *line_delimiter, int format, int encoding) {
+    const char *options[3] = {prefix, suffix, line_delimiter};
+    uint32_t hash = 2166136261U;
+    const char *p;
+    int i;
 
-    header_len = strlen(header);
+    // FNV-1a of the format options
+    for (i = 0; i < 3; i++) {
+        for (p = options[i]; p && *p; p++) {
+            hash = (hash ^ (unsigned char)*p) * 16777619U;
+        }
+        hash = (hash ^ 0xff) * 16777619U;
+    }
+    hash = (hash ^ (unsigned char)format) * 16777619U;
 
-    debug_print("    header len: %lu body len: %lu \n", header_len, body_len);
-    debug_print("'%s'\n", body);
+    return snprintf(etag, size, "\"%llx-%llx-%llx-%08x%s%s\"",
+                    (unsigned long long)epoch,
+                    (unsigned long long)range->first,
+                    (unsigned long long)range->last, hash,
+                    encoding != PH_ENCODING_IDENTITY ? "-" : "",
+                    encoding != PH_ENCODING_IDENTITY
+                        ? gzip_encoding_name(encoding)
+                        : "");
+}
+
+// ETag and Last-Modified header lines. Last-Modified is left out while its
+// second isn't over, a later change in the same second would keep its value.
+int http_header_validators(char *header, unsigned int size, const char *etag,
+                           time_t modified) {
+    char date[64];
+    struct tm tm;
+
+    if (modified >= time(NULL) || !gmtime_r(&modified, &tm) ||
+        !strftime(date, sizeof(date), HTTP_DATE_FORMAT, &tm)) {
+        return snprintf(header, size, "ETag: %s\r\n", etag);
+    }
+
+    return snprintf(header, size, "ETag: %s\r\nLast-Modified: %s\r\n", etag,
+                    date);
+}
+
+// Weak comparison against each tag of an If-None-Match list
+static int http_etag_match(const char *list, const char *etag) {
+    unsigned int etag_len = strlen(etag);
+    const char *p = list, *end;
+    unsigned int len;
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        end = p + strcspn(p, ",");
+        len = end - p;
+        while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) len--;
+        if (len == 1 && *p == '*') return 1;
+        if (len > 2 && strncmp(p, "W/", 2) == 0) {
+            p += 2;
+            len -= 2;
+        }
+        if (len == etag_len && strncmp(p, etag, len) == 0) return 1;
+        p = end;
+    }
+    return 0;
+}
 
-    response_size = header_len + 4 + body_len + 1;
-    char *response = (char *)malloc(response_size);
+// Whether a Range may be answered with part of the body, it may without
+// If-Range or when that names the tag or exactly the Last-Modified date.
+// Weak tags never match.
+int http_range_valid(const ph_http_request_t *req, const char *etag,
+                     time_t modified) {
+    time_t date;
 
-    if (!response) {
+    if (!req->if_range[0]) return 1;
+    if (req->if_range[0] == '"') return strcmp(req->if_range, etag) == 0;
+    if (strncmp(req->if_range, "W/", 2) == 0) return 0;
+
+    date = http_parse_date(req->if_range, strlen(req->if_range));
+    // Last-Modified is only sent once its second is over
+    return date > 0 && date == modified && modified < time(NULL);
+}
+
+// If-None-Match wins over If-Modified-Since when both are sent
+int http_not_modified(const ph_http_request_t *req, const char *etag,
+                      time_t modified) {
+    if (req->if_none_match[0]) return http_etag_match(req->if_none_match, etag);
+    if (req->if_modified_since > 0)
+        return modified <= req->if_modified_since && modified < time(NULL);
+    return 0;
+}
+
+char *http_response_not_modified(const char *etag, time_t modified,
+                                 uint64_t seq, int keep_alive) {
+    char validators[160];
+    char *response = (char *)malloc(384);
+
+    if (!response) return NULL;
+
+    http_header_validators(validators, sizeof(validators), etag, modified);
+    snprintf(response, 384, "%s\r\n%s%s%llu\r\n%s\r\n%s\r\n\r\n",
+             "HTTP/1.1 304 Not Modified", validators, "X-Ph-Seq: ",
+             (unsigned long long)seq, "Vary: Accept-Encoding",
+             http_connection(keep_alive));
+
+    return response;
+}
+
+char *http_response_unsatisfiable(unsigned long int body_len, int keep_alive) {
+    char *response = (char *)malloc(256);
+
+    if (!response) return NULL;
+
+    snprintf(response, 256, "%s\r\n%s%lu\r\n%s\r\n%s\r\n\r\n",
+             "HTTP/1.1 416 Range Not Satisfiable", "Content-Range: bytes */",
+             body_len, "Content-Length: 0", http_connection(keep_alive));
+
+    return response;
+}
+
+// Part of a body_len long body the request range asks for, the whole body
+// when there is no range
+int http_range_resolve(const ph_http_range_t *range,
+                       unsigned long int body_len, ph_http_slice_t *slice) {
+    slice->start = 0;
+    slice->len = body_len;
+
+    if (!range->set) return PH_HTTP_RANGE_FULL;
+
+    if (range->suffix) {
+        if (range->end == 0 || body_len == 0)
+            return PH_HTTP_RANGE_UNSATISFIABLE;
+        if (range->end < body_len) {
+            slice->start = body_len - range->end;
+            slice->len = range->end;
+        }
+        return PH_HTTP_RANGE_PARTIAL;
+    }
+
+    if (range->start >= body_len) return PH_HTTP_RANGE_UNSATISFIABLE;
+    slice->start = range->start;
+    slice->len = (range->end >= body_len ? body_len - 1 : range->end) -
+                 range->start + 1;
+
+    return PH_HTTP_RANGE_PARTIAL;
+}
+
+// HTTP/1.0 has no chunked encoding, the stream is sent as it is and ends
+// with the connection
+int http_header_follow(char *header, unsigned long int size, int sse,
+                       int version) {
+    return snprintf(header, size, "%s\r\n%s\r\n%s%s%s\r\n\r\n",
+                    "HTTP/1.1 200 OK",
+                    sse ? "Content-Type: text/event-stream"
+                        : "Content-Type: text/plain",
+                    sse ? "Cache-Control: no-cache\r\n" : "",
+                    !sse && version >= 1 ? "Transfer-Encoding: chunked\r\n"
+                                         : "",
+                    http_connection(version >= 1));
+}
+
+// seq is the sequence number of the newest message, clients pass it back to
+// GET /since to get only what came after. A slice makes it a 206 response
+// for that part of the body. Only the JSON formats tell their content type.
+int http_header_lines(char *header, unsigned long int size,
+                      unsigned long int body_len,
+                      const ph_http_slice_t *slice, uint64_t seq, int format,
+                      int encoding, const char *validators, int keep_alive) {
+    char coding[64] = "", content_range[96] = "", type[48] = "";
+
+    if (format == PH_FORMAT_JSON || format == PH_FORMAT_NDJSON)
+        snprintf(type, sizeof(type), "Content-Type: %s\r\n",
+                 format == PH_FORMAT_JSON ? "application/json"
+                                          : "application/x-ndjson");
+    if (encoding != PH_ENCODING_IDENTITY)
+        snprintf(coding, sizeof(coding), "Content-Encoding: %s\r\n",
+                 gzip_encoding_name(encoding));
+    if (slice)
+        snprintf(content_range, sizeof(content_range),
+                 "Content-Range: bytes %lu-%lu/%lu\r\n", slice->start,
+                 slice->start + slice->len - 1, body_len);
+
+    return snprintf(header, size,
+                    "%s\r\n%s\r\n%s%s%s%s%lu\r\n%s%llu\r\n%s%s\r\n%s\r\n\r\n",
+                    slice ? "HTTP/1.1 206 Partial Content" : "HTTP/1.1 200 OK",
+                    "Accept-Ranges: bytes", type, coding, content_range,
+                    "Content-Length: ", slice ? slice->len : body_len,
+                    "X-Ph-Seq: ", (unsigned long long)seq,
+                    validators ? validators : "",
+                    "Vary: Accept-Encoding", http_connection(keep_alive));
+}
+
+// Trims an iovec list to len bytes starting at start, returns the new count
+static int http_iov_slice(struct iovec *iov, int iovcnt,
+                          unsigned long int start, unsigned long int len) {
+    int i = 0, n = 0;
+
+    while (i < iovcnt && start >= iov[i].iov_len) start -= iov[i++].iov_len;
+
+    for (; i < iovcnt && len > 0; i++, n++) {
+        iov[n].iov_base = (char *)iov[i].iov_base + start;
+        iov[n].iov_len = iov[i].iov_len - start;
+        if (iov[n].iov_len > len) iov[n].iov_len = len;
+        len -= iov[n].iov_len;
+        start = 0;
+    }
+
+    return n;
+}
+
+// Response as an iovec list referencing the message store through view,
+// header must stay valid until the iovec list is sent. The body length and a
+// requested byte range come from the stored message lengths, an
+// unsatisfiable range gives just the 416 response in header.
+struct iovec *http_response_lines_iov(const ph_ring_view_t *view, char *header,
+                                      unsigned long int size,
+                                      const unsigned int lines,
+                                      const char *prefix, const char *suffix,
+                                      const char *line_delimiter,
+                                      const ph_http_range_t *range,
+                                      const char *validators, int keep_alive,
+                                      int *iovcnt) {
+    struct iovec *iov;
+    ph_http_slice_t slice;
+    unsigned long int body_len =
+        messages_formated_size(view, lines, PH_FORMAT_RAW, prefix, suffix,
+                               line_delimiter);
+    int partial = http_range_resolve(range, body_len, &slice);
+
+    if (!(iov = (struct iovec *)malloc((messages_iov_max(view, lines) + 1) *
+                                       sizeof(struct iovec)))) {
         fprintf(stderr, "Cannot alloc memory for response\n");
         return NULL;
     }
 
-    memset(response, 0, response_size);
-    memcpy(response, header, header_len);
-    memcpy(response + header_len, "\r\n\r\n", 4);
-    memcpy(response + header_len + 4, body, body_len);
-    debug_print("  %ld:%d response length\n", response_size, strlen(response));
+    iov[0].iov_base = header;
+    if (partial == PH_HTTP_RANGE_UNSATISFIABLE) {
+        char *response = http_response_unsatisfiable(body_len, keep_alive);
 
-    return response;
+        if (!response) {
+            free(iov);
+            return NULL;
+        }
+        snprintf(header, size, "%s", response);
+        free(response);
+        iov[0].iov_len = strlen(header);
+        *iovcnt = 1;
+        return iov;
+    }
+
+    iov[0].iov_len = http_header_lines(
+        header, size, body_len, partial ? &slice : NULL, view->last,
+        PH_FORMAT_RAW, PH_ENCODING_IDENTITY, validators, keep_alive);
+    *iovcnt =
+        1 + messages_iov(view, iov + 1, lines, prefix, suffix, line_delimiter);
+    if (partial)
+        *iovcnt = 1 + http_iov_slice(iov + 1, *iovcnt - 1, slice.start,
+                                     slice.len);
+
+    return iov;
 }
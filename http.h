@@ -8,21 +8,116 @@
 #ifndef __PH_HTTP_H
 #define __PH_HTTP_H
 
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+
 #include "config.h"
+#include "gzip.h"
+#include "ring.h"
+
+#define HTTP_BUSY_RESPONSE "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 4\r\nConnection: close\r\n\r\nBUSY"
 
-#define HTTP_ERROR_RESPONSE "HTTP/1.1 404 Not Found.\r\nContent-Length: 9\r\nConnection: Closed\r\n\r\nNOT FOUND"
+#define PH_HTTP_MAX_PATH 256
+// Largest request head (and body) accepted from a client
+#define PH_HTTP_MAX_REQUEST 8192
+#define PH_HTTP_MAX_ETAG 96
+// If-None-Match lists longer than this never match
+#define PH_HTTP_MAX_IF_NONE_MATCH 256
 
 enum http_result {
     PH_HTTP_ERROR = -1,
     PH_HTTP_LINES = 1,    
     PH_HTTP_CLEAR,
     PH_HTTP_CONFIG,
+    PH_HTTP_FOLLOW,
+    PH_HTTP_SINCE,
+    PH_HTTP_STATS,
+    PH_HTTP_GREP,
+    PH_HTTP_TIME_RANGE,
     PH_HTTP_MAX_HTTP
 };
 
-int http_parse_request(char *req, void **result);
+enum http_range_result {
+    PH_HTTP_RANGE_UNSATISFIABLE = -1,
+    PH_HTTP_RANGE_FULL = 0,
+    PH_HTTP_RANGE_PARTIAL
+};
+
+// Range: bytes=start-end, end is inclusive. A suffix range (bytes=-n) has
+// only end set to n, open ranges (bytes=start-) have end UINT64_MAX.
+typedef struct ph_http_range_ {
+    int set;
+    int suffix;
+    uint64_t start;
+    uint64_t end;
+} ph_http_range_t;
+
+// Part of a body to send
+typedef struct ph_http_slice_ {
+    unsigned long int start;
+    unsigned long int len;
+} ph_http_slice_t;
+
+typedef struct ph_http_request_ {
+    char method[8];
+    char path[PH_HTTP_MAX_PATH];
+    int version;
+    int keep_alive;
+    int event_stream;
+    // Preferred content coding from Accept-Encoding
+    int encoding;
+    ph_http_range_t range;
+    char if_none_match[PH_HTTP_MAX_IF_NONE_MATCH];
+    time_t if_modified_since;
+    // Tag or date the Range applies to, a full body is sent otherwise
+    char if_range[PH_HTTP_MAX_ETAG];
+    unsigned long int content_length;
+} ph_http_request_t;
+
+int http_parse(const char *buf, unsigned int len, unsigned int *scanned,
+               ph_http_request_t *req);
+int http_request_channel(ph_http_request_t *req, char *name,
+                         unsigned int size);
+int http_parse_request(const ph_http_request_t *req, void **result);
 int http_parse_request_config(const char *path, ph_config_t *config);
-char *http_response_error(void);
-char *http_response_ok(void);
-char *http_response_lines(const char *body);
-#endif
+int http_query_value(const char *path, const char *key, char *value,
+                     unsigned int size);
+int http_query_time(const char *path, const char *key, uint64_t *ns);
+char *http_response_error(int keep_alive);
+char *http_response_ok(int keep_alive);
+char *http_response_stats(const char *body, unsigned long int body_len,
+                          int prometheus, int keep_alive);
+char *http_response_config(const ph_config_t *config, unsigned int lines,
+                           uint64_t bytes, uint64_t memory, int keep_alive);
+char *http_response_gone(const ph_ring_range_t *range, int keep_alive);
+char *http_response_not_modified(const char *etag, time_t modified,
+                                 uint64_t seq, int keep_alive);
+int http_etag(char *etag, unsigned int size, uint64_t epoch,
+              const ph_ring_range_t *range,
+              const char *prefix, const char *suffix,
+              const char *line_delimiter, int format, int encoding);
+int http_header_validators(char *header, unsigned int size, const char *etag,
+                           time_t modified);
+int http_not_modified(const ph_http_request_t *req, const char *etag,
+                      time_t modified);
+int http_range_valid(const ph_http_request_t *req, const char *etag,
+                     time_t modified);
+char *http_response_unsatisfiable(unsigned long int body_len, int keep_alive);
+int http_range_resolve(const ph_http_range_t *range,
+                       unsigned long int body_len, ph_http_slice_t *slice);
+int http_header_lines(char *header, unsigned long int size,
+                      unsigned long int body_len,
+                      const ph_http_slice_t *slice, uint64_t seq, int format,
+                      int encoding, const char *validators, int keep_alive);
+int http_header_follow(char *header, unsigned long int size, int sse,
+                       int version);
+struct iovec *http_response_lines_iov(const ph_ring_view_t *view, char *header,
+                                      unsigned long int size,
+                                      const unsigned int lines,
+                                      const char *prefix, const char *suffix,
+                                      const char *line_delimiter,
+                                      const ph_http_range_t *range,
+                                      const char *validators, int keep_alive,
+                                      int *iovcnt);
+#endif
\ No newline at end of file
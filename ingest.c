@@ -0,0 +1,373 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#define _GNU_SOURCE
+#include "ingest.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "channel.h"
+#include "debug.h"
+#include "messages.h"
+
+static ph_ingest_t ingest = {.wake_fd = -1, .pass_pipe = {-1, -1}};
+
+int ingest_add(int fd, struct ph_channel_ *channel) {
+    if (ingest.inputs_count == PH_CONFIG_MAX_CHANNELS + 1) return -1;
+
+    ingest.inputs[ingest.inputs_count].fd = fd;
+    ingest.inputs[ingest.inputs_count].channel = channel;
+    ingest.inputs[ingest.inputs_count].burst = 0;
+    ingest.inputs_count++;
+
+    return 0;
+}
+
+static void ingest_wake(int fd) {
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write() error");
+}
+
+// Passthrough bypasses stdio when stdin is a pipe, stdout gets the same
+// pages without them being copied. It is only right while every byte gets
+// stored, so it is picked at start when nothing limits stdin. Rate limiting
+// or block mode set later change what is stored, not what is passed on.
+static void ingest_pass_init(void) {
+    const ph_config_t *config = NULL;
+    struct stat in, out;
+    unsigned int i;
+
+    ingest.pass = PH_INGEST_PASS_NONE;
+    for (i = 0; i < ingest.inputs_count; i++) {
+        if (ingest.inputs[i].fd == STDIN_FILENO)
+            config = ingest.inputs[i].channel->config;
+    }
+    if (!config || !config->output_stdin || config->block_mode ||
+        config->rate > 0) {
+        return;
+    }
+    if (fstat(STDIN_FILENO, &in) < 0 || !S_ISFIFO(in.st_mode) ||
+        fstat(STDOUT_FILENO, &out) < 0) {
+        return;
+    }
+
+    if (S_ISFIFO(out.st_mode)) {
+        ingest.pass = PH_INGEST_PASS_TEE;
+    } else if ((S_ISREG(out.st_mode) || S_ISSOCK(out.st_mode)) &&
+               pipe2(ingest.pass_pipe, O_CLOEXEC) == 0) {
+        // A whole slot has to fit in the pipe
+        fcntl(ingest.pass_pipe[1], F_SETPIPE_SZ, PH_INGEST_SLOT_SIZE);
+        ingest.pass = PH_INGEST_PASS_SPLICE;
+    }
+    ingest.passthrough = ingest.pass != PH_INGEST_PASS_NONE;
+    debug_print("Passthrough mode %d\n", ingest.pass);
+}
+
+static int ingest_passing(const ph_ingest_input_t *input) {
+    return ingest.passthrough && input->fd == STDIN_FILENO &&
+           config_get(input->channel->config, output_stdin);
+}
+
+// Returns 1 when the writer outputs what channel stores, stdin passed
+// through by the ingest thread isn't output again
+unsigned int ingest_output(const struct ph_channel_ *channel) {
+    return config_get(channel->config, output_stdin) &&
+           !(ingest.passthrough && channel->id == 0);
+}
+
+static void ingest_write(const char *data, unsigned int len) {
+    ssize_t rc;
+
+    while (len > 0) {
+        if ((rc = write(STDOUT_FILENO, data, len)) < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0) {
+            perror("write() error");
+            return;
+        }
+        data += rc;
+        len -= rc;
+    }
+}
+
+// Moves len bytes teed into our pipe on to stdout. When splice can't write
+// there the bytes go out of data instead and splice isn't tried again.
+static void ingest_splice(const char *data, unsigned int len) {
+    char discard[4096];
+    unsigned int moved = 0;
+    ssize_t rc;
+
+    while (moved < len) {
+        rc = splice(ingest.pass_pipe[0], NULL, STDOUT_FILENO, NULL,
+                    len - moved, SPLICE_F_MOVE);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) break;
+        moved += rc;
+    }
+    if (moved == len) return;
+
+    ingest.pass = PH_INGEST_PASS_WRITE;
+    ingest_write(data + moved, len - moved);
+    while (moved < len &&
+           (rc = read(ingest.pass_pipe[0], discard,
+                      len - moved < sizeof(discard) ? len - moved
+                                                    : sizeof(discard))) > 0) {
+        moved += rc;
+    }
+}
+
+// Reads what is there into slot, duplicating it to stdout first when
+// passthrough is on
+static ssize_t ingest_read_slot(ph_ingest_input_t *input,
+                                ph_ingest_slot_t *slot) {
+    int out = ingest.pass == PH_INGEST_PASS_TEE ? STDOUT_FILENO
+                                                : ingest.pass_pipe[1];
+    ssize_t rc, teed;
+
+    if (!ingest_passing(input)) {
+        return read(input->fd, slot->data, PH_INGEST_SLOT_SIZE);
+    }
+
+    if (ingest.pass != PH_INGEST_PASS_WRITE) {
+        if ((teed = tee(input->fd, out, PH_INGEST_SLOT_SIZE, 0)) < 0) {
+            if (errno != EINVAL) return teed;
+            // Not a pipe after all, what is read is written out
+            ingest.pass = PH_INGEST_PASS_WRITE;
+        } else if (teed == 0) {
+            return read(input->fd, slot->data, PH_INGEST_SLOT_SIZE);
+        } else {
+            // Nobody else reads the pipe, the bytes teed are there
+            do {
+                rc = read(input->fd, slot->data, teed);
+            } while (rc < 0 && errno == EINTR);
+            if (ingest.pass == PH_INGEST_PASS_SPLICE && rc > 0) {
+                ingest_splice(slot->data, rc);
+            }
+            return rc;
+        }
+    }
+
+    if ((rc = read(input->fd, slot->data, PH_INGEST_SLOT_SIZE)) > 0) {
+        ingest_write(slot->data, rc);
+    }
+
+    return rc;
+}
+
+// Takes the slot for the next read, NULL when the writer has to free one
+// first
+static ph_ingest_slot_t *ingest_slot(void) {
+    uint64_t head = ingest.head;
+
+    if (head - __atomic_load_n(&ingest.tail, __ATOMIC_SEQ_CST) ==
+        PH_INGEST_SLOTS) {
+        __atomic_store_n(&ingest.waiting, 1, __ATOMIC_SEQ_CST);
+        // The writer may have freed one before it saw the flag
+        if (head - __atomic_load_n(&ingest.tail, __ATOMIC_SEQ_CST) ==
+            PH_INGEST_SLOTS) {
+            return NULL;
+        }
+        __atomic_store_n(&ingest.waiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+    return &ingest.slots[head % PH_INGEST_SLOTS];
+}
+
+// Hands the filled slot to the writer. Returns 1 when the writer had
+// caught up and may be asleep.
+static int ingest_publish(ph_ingest_slot_t *slot, ph_ingest_input_t *input,
+                          unsigned int len, int end, int eof) {
+    uint64_t head = ingest.head;
+
+    slot->channel = input->channel;
+    slot->len = len;
+    slot->end = end;
+    slot->eof = eof;
+
+    __atomic_store_n(&ingest.head, head + 1, __ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&ingest.tail, __ATOMIC_SEQ_CST) == head;
+}
+
+// Reads input until it would block. Returns -1 when all slots are taken.
+static int ingest_read(ph_ingest_input_t *input, int *notify) {
+    ph_ingest_slot_t *slot;
+    ssize_t rc;
+
+    while (1) {
+        if (!(slot = ingest_slot())) return -1;
+
+        if ((rc = ingest_read_slot(input, slot)) < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("read() error");
+            // Block mode saves what came at once
+            if (input->burst) {
+                *notify |= ingest_publish(slot, input, 0, 1, 0);
+                input->burst = 0;
+            }
+            return 0;
+        }
+
+        *notify |= ingest_publish(slot, input, rc, rc == 0, rc == 0);
+        if (rc == 0) {
+            debug_print("Input %d closed\n", input->fd);
+            // Channel inputs are opened here, stdin belongs to the process
+            if (input->channel->id > 0) close(input->fd);
+            input->fd = -1;
+            return 0;
+        }
+        input->burst = input->channel->config->block_mode;
+    }
+}
+
+static void *ingest_run(void *arg) {
+    struct pollfd fds[PH_CONFIG_MAX_CHANNELS + 2];
+    ph_ingest_input_t *polled[PH_CONFIG_MAX_CHANNELS + 2];
+    unsigned int i, n;
+    uint64_t value;
+    int full = 0, notify;
+
+    (void)arg;
+    while (!__atomic_load_n(&ingest.stop, __ATOMIC_ACQUIRE)) {
+        fds[0].fd = ingest.wake_fd;
+        fds[0].events = POLLIN;
+        n = 1;
+        // With no free slot only the writer can get things going again
+        for (i = 0; !full && i < ingest.inputs_count; i++) {
+            if (ingest.inputs[i].fd < 0) continue;
+            fds[n].fd = ingest.inputs[i].fd;
+            fds[n].events = POLLIN;
+            polled[n++] = &ingest.inputs[i];
+        }
+
+        if (poll(fds, n, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll() error");
+            break;
+        }
+        if (fds[0].revents) {
+            while (read(ingest.wake_fd, &value, sizeof(value)) > 0)
+                ;
+        }
+
+        notify = 0;
+        if (full) {
+            // Inputs weren't watched, try them all
+            full = 0;
+            for (i = 0; !full && i < ingest.inputs_count; i++) {
+                if (ingest.inputs[i].fd < 0) continue;
+                full = ingest_read(&ingest.inputs[i], &notify) < 0;
+            }
+        } else {
+            for (i = 1; !full && i < n; i++) {
+                if (!fds[i].revents) continue;
+                full = ingest_read(polled[i], &notify) < 0;
+            }
+        }
+        if (notify) server_notify(ingest.writer);
+    }
+
+    return NULL;
+}
+
+// Stores the reads the ingest thread queued, only the writer server may call
+// it. Returns how many were stored.
+unsigned int ingest_drain(void) {
+    uint64_t tail = ingest.tail;
+    unsigned int count = 0;
+
+    while (__atomic_load_n(&ingest.head, __ATOMIC_SEQ_CST) != tail) {
+        ph_ingest_slot_t *slot = &ingest.slots[tail % PH_INGEST_SLOTS];
+        ph_channel_t *channel = slot->channel;
+        ph_config_t *config = channel->config;
+        ph_messages_t *messages = &channel->messages;
+        unsigned int output = ingest_output(channel);
+
+        // Stored out of the slot, only an unfinished record is copied
+        message_input_data(messages, slot->data, slot->len, output,
+                           config->block_mode);
+        if (slot->eof) {
+            message_input_end(messages, output, config->block_mode);
+        }
+        // Only save a complete block, rate limiting decides if it is kept
+        if (slot->end && config->block_mode) {
+            message_check_save(messages, output);
+        }
+
+        __atomic_store_n(&ingest.tail, ++tail, __ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&ingest.waiting, 0, __ATOMIC_SEQ_CST)) {
+            ingest_wake(ingest.wake_fd);
+        }
+        count++;
+    }
+
+    return count;
+}
+
+static void ingest_free(void) {
+    unsigned int i;
+
+    for (i = 0; i < PH_INGEST_SLOTS; i++) {
+        free(ingest.slots[i].data);
+        ingest.slots[i].data = NULL;
+    }
+    if (ingest.wake_fd >= 0) close(ingest.wake_fd);
+    if (ingest.pass_pipe[0] >= 0) close(ingest.pass_pipe[0]);
+    if (ingest.pass_pipe[1] >= 0) close(ingest.pass_pipe[1]);
+    ingest.wake_fd = ingest.pass_pipe[0] = ingest.pass_pipe[1] = -1;
+    ingest.writer = NULL;
+    ingest.passthrough = 0;
+}
+
+// Starts reading the inputs added so far on their own thread, writer is
+// woken up to store what was read
+int ingest_start(ph_server_t *writer) {
+    unsigned int i;
+    int rc;
+
+    ingest.writer = writer;
+    for (i = 0; i < PH_INGEST_SLOTS; i++) {
+        if (!(ingest.slots[i].data = (char *)malloc(PH_INGEST_SLOT_SIZE))) {
+            fprintf(stderr, "Cannot allocate ingest buffers\n");
+            ingest_free();
+            return -1;
+        }
+    }
+
+    if ((ingest.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("eventfd() error");
+        ingest_free();
+        return -1;
+    }
+    ingest_pass_init();
+
+    if ((rc = pthread_create(&ingest.thread, NULL, ingest_run, NULL))) {
+        fprintf(stderr, "Cannot start ingest thread: %s\n", strerror(rc));
+        ingest_free();
+        return -1;
+    }
+
+    return 0;
+}
+
+void ingest_stop(void) {
+    if (!ingest.writer) return;
+
+    __atomic_store_n(&ingest.stop, 1, __ATOMIC_RELEASE);
+    ingest_wake(ingest.wake_fd);
+    pthread_join(ingest.thread, NULL);
+    ingest_free();
+}
\ No newline at end of file
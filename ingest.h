@@ -0,0 +1,81 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_INGEST_H
+#define __PH_INGEST_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "server.h"
+
+// Slots must be a power of two, each holds one read
+#define PH_INGEST_SLOTS 32
+#define PH_INGEST_SLOT_SIZE (64 * 1024)
+
+struct ph_channel_;
+
+// Set once at start, with anything but none the ingest thread is the only
+// one writing stdin to stdout and the writer never does
+enum ingest_pass {
+    PH_INGEST_PASS_NONE = 0,
+    // stdout is a pipe, stdin is duplicated into it with tee()
+    PH_INGEST_PASS_TEE,
+    // stdin is duplicated into a pipe of ours and spliced to stdout
+    PH_INGEST_PASS_SPLICE,
+    // tee() or splice() failed, what was read is written out
+    PH_INGEST_PASS_WRITE
+};
+
+typedef struct ph_ingest_input_ {
+    int fd;
+    struct ph_channel_ *channel;
+    // Block mode data was read since the last end
+    int burst;
+} ph_ingest_input_t;
+
+// One read of an input. End marks the last read of a burst, block mode
+// saves there, eof that the input is closed.
+typedef struct ph_ingest_slot_ {
+    struct ph_channel_ *channel;
+    char *data;
+    unsigned int len;
+    unsigned short int end;
+    unsigned short int eof;
+} ph_ingest_slot_t;
+
+/*
+ * The ingest thread reads every input into the slots of a single producer,
+ * single consumer ring and the writer server stores them, so a busy server
+ * doesn't keep the inputs from being drained. head and tail only grow, the
+ * side that finds the other one waiting after publishing wakes it up.
+ */
+typedef struct ph_ingest_ {
+    pthread_t thread;
+    ph_server_t *writer;
+    ph_ingest_input_t inputs[PH_CONFIG_MAX_CHANNELS + 1];
+    unsigned int inputs_count;
+    ph_ingest_slot_t slots[PH_INGEST_SLOTS];
+    uint64_t head;
+    uint64_t tail;
+    // Set by the ingest thread while it waits for a free slot
+    int waiting;
+    int wake_fd;
+    int stop;
+    int pass;
+    // Set before the thread starts, stdin goes to stdout on this thread only
+    int passthrough;
+    int pass_pipe[2];
+} ph_ingest_t;
+
+int ingest_add(int fd, struct ph_channel_ *channel);
+int ingest_start(ph_server_t *writer);
+void ingest_stop(void);
+unsigned int ingest_drain(void);
+unsigned int ingest_output(const struct ph_channel_ *channel);
+
+#endif
\ No newline at end of file
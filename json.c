@@ -0,0 +1,132 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#include "json.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// 16 bytes looked at together, GCC and clang make SSE2 or NEON of it
+typedef unsigned char json_v16_t __attribute__((vector_size(16)));
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define json_first(w) (__builtin_clzll(w) / 8)
+#else
+#define json_first(w) (__builtin_ctzll(w) / 8)
+#endif
+
+static int json_special(unsigned char c) {
+    return c < 0x20 || c == '"' || c == '\\';
+}
+
+// Offset of the first byte to escape in the 16 at s, 16 when there is none
+static unsigned int json_scan16(const char *s) {
+    json_v16_t v, special;
+    uint64_t w[2];
+
+    memcpy(&v, s, sizeof(v));
+    special = (json_v16_t)((v < 0x20) | (v == '"') | (v == '\\'));
+    memcpy(w, &special, sizeof(w));
+    if (w[0]) return json_first(w[0]);
+    if (w[1]) return 8 + json_first(w[1]);
+
+    return 16;
+}
+
+// Offset of the first byte to escape, len when there is none. The last 16
+// bytes are looked at again instead of one by one.
+unsigned int json_scan(const char *s, unsigned int len) {
+    unsigned int i, n;
+
+    if (len < 16) {
+        for (i = 0; i < len; i++) {
+            if (json_special(s[i])) return i;
+        }
+        return len;
+    }
+    for (i = 0; i + 16 <= len; i += 16) {
+        if ((n = json_scan16(s + i)) < 16) return i + n;
+    }
+    if (i < len && (n = json_scan16(s + len - 16)) < 16) return len - 16 + n;
+
+    return len;
+}
+
+static unsigned int json_char_len(unsigned char c) {
+    if (c == '"' || c == '\\') return 2;
+    if (c >= 0x20) return 1;
+
+    switch (c) {
+        case '\b':
+        case '\f':
+        case '\n':
+        case '\r':
+        case '\t':
+            return 2;
+    }
+    return 6;
+}
+
+unsigned int json_escaped_len(const char *s, unsigned int len) {
+    unsigned int i = 0, out = 0, clean;
+
+    while (i < len) {
+        clean = json_scan(s + i, len - i);
+        out += clean;
+        i += clean;
+        if (i < len) out += json_char_len(s[i++]);
+    }
+
+    return out;
+}
+
+// Writes s escaped to out, which must hold json_escaped_len() bytes. Returns
+// the bytes written.
+unsigned int json_escape(char *out, const char *s, unsigned int len) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned int i = 0, o = 0, clean;
+    unsigned char c;
+
+    while (i < len) {
+        clean = json_scan(s + i, len - i);
+        memcpy(out + o, s + i, clean);
+        o += clean;
+        i += clean;
+        if (i == len) break;
+
+        c = s[i++];
+        out[o++] = '\\';
+        switch (c) {
+            case '"':
+            case '\\':
+                out[o++] = c;
+                break;
+            case '\b':
+                out[o++] = 'b';
+                break;
+            case '\f':
+                out[o++] = 'f';
+                break;
+            case '\n':
+                out[o++] = 'n';
+                break;
+            case '\r':
+                out[o++] = 'r';
+                break;
+            case '\t':
+                out[o++] = 't';
+                break;
+            default:
+                memcpy(out + o, "u00", 3);
+                out[o + 3] = hex[c >> 4];
+                out[o + 4] = hex[c & 0xf];
+                o += 5;
+                break;
+        }
+    }
+
+    return o;
+}
\ No newline at end of file
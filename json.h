@@ -0,0 +1,16 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_JSON_H
+#define __PH_JSON_H
+
+// Escaping for the contents of a JSON string. Quotes, backslashes and
+// control characters are escaped, other bytes are passed as they are.
+unsigned int json_scan(const char *s, unsigned int len);
+unsigned int json_escaped_len(const char *s, unsigned int len);
+unsigned int json_escape(char *out, const char *s, unsigned int len);
+
+#endif
\ No newline at end of file
@@ -4,160 +4,1038 @@
  *    The MIT License (MIT)
  * 
  */
+#define _GNU_SOURCE
 #include "messages.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include <sys/uio.h>
 
+#include "cache.h"
 #include "config.h"
 #include "debug.h"
-#include "dlist.h"
+#include "json.h"
+#include "ring.h"
 
-static DList messages;
-static char *message = NULL;
-static unsigned int message_size = 0, message_alloc_size = 0;
+static void messages_changed(ph_messages_t *messages) {
+    __atomic_store_n(&messages->modified, time(NULL), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&messages->generation, 1, __ATOMIC_RELEASE);
+}
+
+void message_free(ph_messages_t *messages) {
+    if (messages->trigram) {
+        trigram_free(messages->trigram);
+        free(messages->trigram);
+        messages->trigram = NULL;
+    }
+    free(messages->input);
+    messages->input = NULL;
+    free(messages->pending);
+    messages->pending = NULL;
+    free(messages->json);
+    messages->json = NULL;
+    ring_free(&messages->ring);
+    pthread_mutex_destroy(&messages->lock);
+}
+
+// With a path the messages are kept in a file of size data bytes and survive
+// restarts
+int messages_init(ph_messages_t *messages, unsigned int lines,
+                  uint64_t max_bytes, const char *path, uint64_t size) {
+    int rc;
 
-struct timespec ts_last;
-struct timespec ts_now;
+    memset(messages, 0, sizeof(ph_messages_t));
+    pthread_mutex_init(&messages->lock, NULL);
 
-static int message_new(void) {
-    if (!(message = (char *)malloc(READ_BUF_LEN))) {
+    rc = path ? ring_init_file(&messages->ring, path, lines, size)
+              : ring_init(&messages->ring, lines);
+    if (rc < 0) {
+        return -1;
+    }
+    ring_resize(&messages->ring, lines, max_bytes);
+    if (!(messages->input = (char *)malloc(PH_MESSAGES_INPUT_SIZE))) {
         fprintf(stderr, "Cannot allocate buffer\n");
+        ring_free(&messages->ring);
+        return -1;
+    }
+    messages->input_size = PH_MESSAGES_INPUT_SIZE;
+    messages->modified = time(NULL);
+    messages->rate_burst = 1;
+
+    return 0;
+}
+
+// Starts keeping a trigram index for messages_grep(), messages already
+// stored are indexed right away
+int messages_index(ph_messages_t *messages) {
+    ph_trigram_t *index;
+    ph_ring_t *ring = &messages->ring;
+    uint64_t seq;
+
+    if (messages->trigram) return 0;
+    if (!(index = (ph_trigram_t *)malloc(sizeof(ph_trigram_t)))) return -1;
+    if (trigram_init(index) < 0) {
+        free(index);
+        return -1;
+    }
+
+    pthread_mutex_lock(&messages->lock);
+    for (seq = ring->first; seq <= ring->seq; seq++) {
+        ph_ring_entry_t *e = &ring->index[seq % ring->index_size];
+
+        if (trigram_add(index, seq, ring_data(ring, e), e->len) < 0) break;
+    }
+    if (index->disabled) {
+        pthread_mutex_unlock(&messages->lock);
+        trigram_free(index);
+        free(index);
         return -1;
     }
-    message_size = 0;
-    message_alloc_size = READ_BUF_LEN;
+    messages->trigram = index;
+    pthread_mutex_unlock(&messages->lock);
 
     return 0;
 }
 
-void message_free(void) {
-    free(message);
+void messages_clear(ph_messages_t *messages) {
+    pthread_mutex_lock(&messages->lock);
+    if (messages->trigram) {
+        trigram_write_lock(messages->trigram);
+        trigram_clear(messages->trigram);
+        trigram_unlock(messages->trigram);
+    }
+    ring_clear(&messages->ring);
+    messages_changed(messages);
+    pthread_mutex_unlock(&messages->lock);
+}
+
+void messages_resize(ph_messages_t *messages, unsigned int new_size,
+                     uint64_t max_bytes) {
+    pthread_mutex_lock(&messages->lock);
+    ring_resize(&messages->ring, new_size, max_bytes);
+    if (messages->trigram) {
+        // Evicted entries are rare here, check every list
+        trigram_write_lock(messages->trigram);
+        trigram_sweep(messages->trigram, messages->ring.first,
+                      PH_TRIGRAM_BUCKETS);
+        trigram_unlock(messages->trigram);
+    }
+    messages_changed(messages);
+    pthread_mutex_unlock(&messages->lock);
+}
+
+// Current number of messages, their bytes and the memory held for them. Safe
+// to call from any thread, the values are a snapshot.
+void messages_usage(ph_messages_t *messages, unsigned int *lines,
+                    uint64_t *bytes, uint64_t *memory) {
+    ph_ring_t *ring = &messages->ring;
+    uint64_t first = __atomic_load_n(&ring->first, __ATOMIC_ACQUIRE);
+    uint64_t seq = __atomic_load_n(&ring->seq, __ATOMIC_ACQUIRE);
+
+    *lines = seq + 1 > first ? seq + 1 - first : 0;
+    *bytes = __atomic_load_n(&ring->bytes, __ATOMIC_RELAXED);
+    *memory = ring_memory(ring);
 }
 
-int messages_init(unsigned int lines) {
-    dlist_init(&messages, free, lines);
-    return message_new();
+// Bytes of the JSON escaped copies held next to the messages, not part of
+// the bytes messages_usage() gives
+uint64_t messages_json_bytes(ph_messages_t *messages) {
+    return __atomic_load_n(&messages->ring.json_bytes, __ATOMIC_RELAXED);
 }
 
-void messages_clear(void) { return dlist_clear(&messages); }
-void messages_resize(unsigned int new_size) { return dlist_resize(&messages, new_size); }
+// Copies data after what the input buffer holds, doubling it until it fits
+static int message_input_keep(ph_messages_t *messages, const char *data,
+                              unsigned int len) {
+    unsigned int size = messages->input_size;
+    char *tmp;
 
-int message_add_chunk(char *buffer, int len) {
-    char *tmp = NULL;
-    if ((message_size + len + 1) > message_alloc_size) {
-        fprintf(stderr, "Alloc: %d bytes\n", message_alloc_size + READ_BUF_LEN);
-        tmp = realloc(message, message_alloc_size + READ_BUF_LEN);
-        if (!tmp) {
-            fprintf(stderr, "Cannot realloc message !\n");
+    while (size - messages->input_len < len) size *= 2;
+    if (size != messages->input_size) {
+        debug_print("Input buffer grow: %u bytes\n", size);
+        if (!(tmp = realloc(messages->input, size))) {
+            fprintf(stderr, "Cannot realloc input buffer !\n");
             return -1;
         }
-        message = tmp;
-        message_alloc_size += READ_BUF_LEN;
+        messages->input = tmp;
+        messages->input_size = size;
     }
-    memcpy(message + message_size, buffer, len);
-    message_size += len;
+    memcpy(messages->input + messages->input_len, data, len);
+    messages->input_len += len;
+
     return 0;
 }
 
-int message_check_save(unsigned int rate, unsigned int output) {
-    if (message_size > 0 && message[message_size - 1] == '\n') {
-        message[message_size] = '\0';
+// Sets the token bucket limiting stored messages, one token every interval
+// ms and at most burst of them saved up. In latest mode the newest message
+// refused waits for the next token instead of being dropped. Safe to call
+// from any thread.
+void messages_rate(ph_messages_t *messages, unsigned int interval,
+                   unsigned int burst, unsigned int latest) {
+    __atomic_store_n(&messages->rate_interval, interval, __ATOMIC_RELAXED);
+    __atomic_store_n(&messages->rate_burst, burst > 0 ? burst : 1,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&messages->rate_latest, latest, __ATOMIC_RELAXED);
+}
+
+// Monotonic and wall clock time in nanoseconds
+static void message_clock(uint64_t *ts, uint64_t *wall) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *ts = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    clock_gettime(CLOCK_REALTIME, &now);
+    *wall = now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Adds the tokens earned since the last refill at monotonic time now, one
+// every interval ns. Returns the nanoseconds until the next token when there
+// is none.
+static uint64_t message_rate_refill(ph_messages_t *messages, uint64_t now,
+                                    uint64_t interval) {
+    unsigned int burst =
+        __atomic_load_n(&messages->rate_burst, __ATOMIC_RELAXED);
+    uint64_t earned;
+
+    // A full bucket saves nothing up, its refill starts over
+    if (messages->rate_refill == 0 || messages->rate_tokens >= burst) {
+        messages->rate_tokens = burst;
+        messages->rate_refill = now;
+        return 0;
+    }
 
-        // Check if rate limiting is respected
-        clock_gettime(CLOCK_MONOTONIC, &ts_now);
-        if (ts_last.tv_sec > 0 && ts_now.tv_sec - ts_last.tv_sec < rate) {
-            free(message);
-            debug_print("%s", "Skip save\n");
+    earned = (now - messages->rate_refill) / interval;
+    if (earned > 0) {
+        messages->rate_tokens = earned < burst - messages->rate_tokens
+                                    ? messages->rate_tokens + earned
+                                    : burst;
+        messages->rate_refill += earned * interval;
+    }
+
+    return messages->rate_tokens > 0
+               ? 0
+               : messages->rate_refill + interval - now;
+}
+
+// Takes a token for a message read at monotonic time now. Returns 0 when it
+// may be stored, else the nanoseconds until it could be.
+static uint64_t message_rate_take(ph_messages_t *messages, uint64_t now) {
+    uint64_t interval =
+        __atomic_load_n(&messages->rate_interval, __ATOMIC_RELAXED) *
+        1000000ULL;
+    uint64_t wait;
+
+    if (interval == 0) return 0;
+    if ((wait = message_rate_refill(messages, now, interval)) == 0) {
+        messages->rate_tokens--;
+    }
+
+    return wait;
+}
+
+// Keeps a refused message for messages_flush_pending(), it replaces the one
+// waiting. Returns the messages dropped.
+static unsigned int message_pending_set(ph_messages_t *messages,
+                                        const char *data, unsigned int len,
+                                        uint64_t ts, uint64_t wall) {
+    unsigned int dropped = messages->pending_len > 0;
+    char *tmp;
+
+    if (len > messages->pending_size) {
+        if (!(tmp = realloc(messages->pending, len))) {
+            fprintf(stderr, "Cannot alloc pending message\n");
+            return 1;
+        }
+        messages->pending = tmp;
+        messages->pending_size = len;
+    }
+    memcpy(messages->pending, data, len);
+    messages->pending_len = len;
+    messages->pending_ts = ts;
+    messages->pending_wall = wall;
+
+    return dropped;
+}
+
+// JSON string of a message without its newline, escaped in the scratch
+// buffer. It stays NULL when the message bytes can be used as they are.
+static int message_json(ph_messages_t *messages, const char *data,
+                        unsigned int len, const char **json,
+                        unsigned int *json_len) {
+    unsigned int raw = len > 0 && data[len - 1] == '\n' ? len - 1 : len;
+    unsigned int clean = json_scan(data, raw), size;
+    char *tmp;
+
+    *json = NULL;
+    *json_len = 0;
+    if (clean == raw) return 0;
+
+    size = clean + json_escaped_len(data + clean, raw - clean);
+    if (size > messages->json_size) {
+        if (!(tmp = realloc(messages->json, size))) {
+            fprintf(stderr, "Cannot alloc JSON buffer\n");
+            return -1;
+        }
+        messages->json = tmp;
+        messages->json_size = size;
+    }
+    memcpy(messages->json, data, clean);
+    *json_len = clean + json_escape(messages->json + clean, data + clean,
+                                    raw - clean);
+    *json = messages->json;
+
+    return 0;
+}
+
+// Inserts one message, the caller holds the store and index locks. Messages
+// that need escaping keep their JSON string next to them, it is made once
+// here instead of on every JSON response.
+static int message_store(ph_messages_t *messages, const char *data,
+                         unsigned int len, uint64_t ts, uint64_t wall) {
+    unsigned int json_len;
+    const char *json;
+    int rc = -1;
+
+    if (message_json(messages, data, len, &json, &json_len) < 0 ||
+        (rc = ring_insert(&messages->ring, data, len, json, json_len, ts,
+                          wall)) < 0) {
+        // Counted, every line of an oversized input would repeat it
+        if (rc == PH_RING_OVERSIZE) {
+            __atomic_store_n(&messages->lines_oversize,
+                             messages->lines_oversize + 1, __ATOMIC_RELAXED);
         } else {
-            clock_gettime(CLOCK_MONOTONIC, &ts_last);
-            dlist_insert(&messages, NULL, message);
-            if (output) {
-                fprintf(stdout, "%s", message);
-                fflush(stdout);
-            }
+            fprintf(stderr, "Cannot save message\n");
         }
-        return message_new();
+        return -1;
     }
+    // A disabled index is skipped by messages_grep(), the message is kept
+    if (messages->trigram) {
+        trigram_add(messages->trigram, messages->ring.seq, data, len);
+    }
+
     return 0;
 }
 
-char *message_get_current() { return message; }
+static void message_store_begin(ph_messages_t *messages) {
+    pthread_mutex_lock(&messages->lock);
+    if (messages->trigram) trigram_write_lock(messages->trigram);
+}
 
-char *messages_get_formated(const unsigned int lines, const char *prefix,
-                            const char *suffix, const char *line_delimiter) {
-    unsigned long int total_messages_size = 0;
-    unsigned int prefix_len = 0;
-    unsigned int suffix_len = 0;
-    unsigned int line_delimiter_len = 0;
+static void message_store_end(ph_messages_t *messages, uint64_t lines,
+                              uint64_t bytes, uint64_t dropped) {
+    if (messages->trigram) {
+        trigram_sweep(messages->trigram, messages->ring.first,
+                      lines * PH_TRIGRAM_SWEEP);
+        trigram_unlock(messages->trigram);
+    }
+    if (lines > 0) messages_changed(messages);
+    pthread_mutex_unlock(&messages->lock);
 
-    DListElmt *e;
+    __atomic_store_n(&messages->lines_stored,
+                     messages->lines_stored + lines, __ATOMIC_RELAXED);
+    __atomic_store_n(&messages->bytes_stored,
+                     messages->bytes_stored + bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&messages->lines_dropped,
+                     messages->lines_dropped + dropped, __ATOMIC_RELAXED);
+}
 
-    debug_print("Requested lines: %u\n", lines);
+// Stores the first complete bytes of input, one message per line when split
+// is set. Records read together share the time, each one needs a rate
+// limiting token.
+static void message_save(ph_messages_t *messages, const char *input,
+                         unsigned int complete, unsigned int split,
+                         unsigned int output) {
+    const char *p, *eol, *end = input + complete;
+    // Start of the records passed to stdout together
+    const char *run = input;
+    uint64_t ts, wall, lines = 0, bytes = 0, dropped = 0;
 
-    if (prefix) {
-        prefix_len = strlen(prefix);
+    message_clock(&ts, &wall);
+    message_store_begin(messages);
+    for (p = input; p < end; p = eol + 1) {
+        eol = split ? memchr(p, '\n', end - p) : NULL;
+        if (!eol) eol = end - 1;
+
+        if (message_rate_take(messages, ts) > 0) {
+            dropped += __atomic_load_n(&messages->rate_latest,
+                                       __ATOMIC_RELAXED)
+                           ? message_pending_set(messages, p, eol + 1 - p,
+                                                 ts, wall)
+                           : 1;
+            if (output && p > run) fwrite(run, 1, p - run, stdout);
+            run = eol + 1;
+            continue;
+        }
+        // Anything waiting is older than this message
+        dropped += messages->pending_len > 0;
+        messages->pending_len = 0;
+
+        if (message_store(messages, p, eol + 1 - p, ts, wall) == 0) {
+            lines++;
+            bytes += eol + 1 - p;
+        }
     }
+    message_store_end(messages, lines, bytes, dropped);
+    if (output) {
+        if (end > run) fwrite(run, 1, end - run, stdout);
+        fflush(stdout);
+    }
+}
 
-    if (suffix) {
-        suffix_len = strlen(suffix);
+// Stores the first complete bytes of the input buffer and keeps the rest for
+// the next read
+static void message_input_save(ph_messages_t *messages, unsigned int complete,
+                               unsigned int split, unsigned int output) {
+    message_save(messages, messages->input, complete, split, output);
+    messages->input_len -= complete;
+    memmove(messages->input, messages->input + complete,
+            messages->input_len);
+}
+
+// Stores the message held back in latest mode once a token is there. Returns
+// the ms until it can be stored, 0 when it was stored now and -1 when none
+// is waiting. Only the writer thread may call it.
+int messages_flush_pending(ph_messages_t *messages, unsigned int output) {
+    uint64_t ts, wall, wait;
+    int stored;
+
+    if (messages->pending_len == 0) return -1;
+
+    message_clock(&ts, &wall);
+    if ((wait = message_rate_take(messages, ts)) > 0) {
+        return (int)((wait + 999999) / 1000000);
     }
 
-    if (line_delimiter) {
-        line_delimiter_len = strlen(line_delimiter);
+    message_store_begin(messages);
+    // The time it was read at, not the time it was let through
+    stored = message_store(messages, messages->pending,
+                           messages->pending_len, messages->pending_ts,
+                           messages->pending_wall) == 0;
+    message_store_end(messages, stored, stored ? messages->pending_len : 0,
+                      0);
+    if (output) {
+        fwrite(messages->pending, 1, messages->pending_len, stdout);
+        fflush(stdout);
     }
+    messages->pending_len = 0;
 
-    unsigned int l;
-    for (l = 0, e = dlist_head(&messages); e != NULL && l < lines;
-         e = e->next, l++) {
-        if (e->data) {
-            total_messages_size += strlen((char *)e->data);
-            if (line_delimiter && l < lines - 1 && e->next != NULL) {
-                total_messages_size += line_delimiter_len;
-            }
+    return 0;
+}
+
+// Stores len bytes read into data. In line mode complete lines are stored
+// straight out of data and only an unfinished one is copied to the input
+// buffer, in block mode the input accumulates until message_check_save()
+// finds it ends in a newline.
+int message_input_data(ph_messages_t *messages, const char *data,
+                       unsigned int len, unsigned int output,
+                       unsigned int block) {
+    const char *eol;
+    unsigned int n;
+
+    if (block) return message_input_keep(messages, data, len);
+
+    // The line held from the previous reads goes first
+    if (messages->input_len > 0 && (eol = memchr(data, '\n', len))) {
+        n = eol + 1 - data;
+        if (message_input_keep(messages, data, n) < 0) return -1;
+        message_input_save(messages, messages->input_len, 0, output);
+        data += n;
+        len -= n;
+    }
+    if (messages->input_len == 0 && (eol = memrchr(data, '\n', len))) {
+        n = eol + 1 - data;
+        message_save(messages, data, n, 1, output);
+        data += n;
+        len -= n;
+    }
+    if (len == 0) return 0;
+
+    if (message_input_keep(messages, data, len) < 0) return -1;
+    // Don't hold an endless line, store what came so far
+    if (messages->input_len >= MAX_READ_SIZE) {
+        message_input_save(messages, messages->input_len, 0, output);
+    }
+
+    return 0;
+}
+
+// Block mode, saves everything read so far as one message if it ends in a
+// newline
+int message_check_save(ph_messages_t *messages, unsigned int output) {
+    if (messages->input_len > 0 &&
+        messages->input[messages->input_len - 1] == '\n') {
+        message_input_save(messages, messages->input_len, 0, output);
+    }
+    return 0;
+}
+
+// The input is closed, a last line without newline is still a message
+void message_input_end(ph_messages_t *messages, unsigned int output,
+                       unsigned int block) {
+    if (!block && messages->input_len > 0) {
+        message_input_save(messages, messages->input_len, 0, output);
+    }
+}
+
+unsigned long int messages_generation(ph_messages_t *messages) {
+    return __atomic_load_n(&messages->generation, __ATOMIC_ACQUIRE);
+}
+
+void messages_read_begin(ph_messages_t *messages, ph_ring_view_t *view) {
+    ring_read_begin(&messages->ring, view);
+}
+
+// Returns 0 when everything read through the view for messages from oldest
+// on is still intact, -1 when the writer replaced some of it and the read
+// must be repeated
+int messages_read_end(ph_messages_t *messages, ph_ring_view_t *view,
+                      uint64_t oldest) {
+    int valid = ring_view_valid(&messages->ring, view, oldest);
+
+    ring_read_end(&messages->ring);
+
+    return valid ? 0 : -1;
+}
+
+uint64_t messages_view_oldest(const ph_ring_view_t *view,
+                              const unsigned int lines) {
+    return view->last + 1 - messages_count(view, lines);
+}
+
+uint64_t messages_last_seq(ph_messages_t *messages) {
+    return __atomic_load_n(&messages->ring.seq, __ATOMIC_ACQUIRE);
+}
+
+// Tells this store apart from others and from itself before a restart
+// without a file, sequence numbers alone don't
+uint64_t messages_epoch(ph_messages_t *messages) {
+    return messages->ring.epoch;
+}
+
+time_t messages_modified(ph_messages_t *messages) {
+    return __atomic_load_n(&messages->modified, __ATOMIC_RELAXED);
+}
+
+// Range a response for lines messages newer than since would have now, taken
+// from the store counters without reading any message
+void messages_current_range(ph_messages_t *messages, uint64_t since,
+                            const unsigned int lines, ph_ring_range_t *range) {
+    ph_ring_t *ring = &messages->ring;
+
+    do {
+        range->last = __atomic_load_n(&ring->seq, __ATOMIC_ACQUIRE);
+        range->first = __atomic_load_n(&ring->first, __ATOMIC_ACQUIRE);
+    } while (range->last != __atomic_load_n(&ring->seq, __ATOMIC_ACQUIRE));
+
+    if (since >= range->last) {
+        range->first = range->last + 1;
+    } else if (since >= range->first) {
+        range->first = since + 1;
+    }
+    if (lines > 0 && range->last + 1 - range->first > lines) {
+        range->first = range->last + 1 - lines;
+    }
+}
+
+// Restricts the view to messages newer than since
+void messages_view_since(ph_ring_view_t *view, uint64_t since) {
+    if (since >= view->last) {
+        view->first = view->last + 1;
+    } else if (since >= view->first) {
+        view->first = since + 1;
+    }
+}
+
+// Restricts the view to messages stored from from to to, wall clock
+// nanoseconds with both ends included
+void messages_view_time(ph_ring_view_t *view, uint64_t from, uint64_t to) {
+    uint64_t first = ring_view_find(view, from);
+    uint64_t end = to < UINT64_MAX ? ring_view_find(view, to + 1)
+                                   : view->last + 1;
+
+    if (end < first) end = first;
+    view->first = first;
+    view->last = end - 1;
+}
+
+void messages_view_range(const ph_ring_view_t *view, const unsigned int lines,
+                         ph_ring_range_t *range) {
+    range->first = messages_view_oldest(view, lines);
+    range->last = view->last;
+}
+
+// A cursor is usable while no message newer than it was evicted and it isn't
+// ahead of the store, as happens after a restart
+int messages_cursor_valid(uint64_t since, const ph_ring_range_t *range) {
+    return since + 1 >= range->first && since <= range->last;
+}
+
+unsigned int messages_count(const ph_ring_view_t *view,
+                            const unsigned int lines) {
+    unsigned int count = ring_view_count(view);
+
+    if (lines > 0 && lines < count) {
+        count = lines;
+    }
+    return count;
+}
+
+static unsigned int messages_digits(uint64_t v) {
+    unsigned int n = 1;
+
+    for (; v >= 100; v /= 100) n += 2;
+
+    return n + (v >= 10);
+}
+
+// Writes v in decimal with at least digits digits, returns the length. Two
+// digits are made at once.
+static unsigned int messages_uint(char *buf, uint64_t v, unsigned int digits) {
+    static const char pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233"
+        "34353637383940414243444546474849505152535455565758596061626364656667"
+        "6869707172737475767778798081828384858687888990919293949596979899";
+    unsigned int n = messages_digits(v), i;
+
+    if (n < digits) n = digits;
+    for (i = n; i >= 2; i -= 2, v /= 100) {
+        memcpy(buf + i - 2, pairs + v % 100 * 2, 2);
+    }
+    if (i) buf[0] = '0' + v;
+
+    return n;
+}
+
+// Seconds and microseconds of the wall clock ingest time of a message
+static unsigned int messages_time(char *buf, const ph_ring_entry_t *e) {
+    unsigned int n = messages_uint(buf, e->wall / 1000000000ULL, 1);
+
+    buf[n++] = '.';
+    return n + messages_uint(buf + n, e->wall % 1000000000ULL / 1000, 6);
+}
+
+// Writes the PH_FORMAT_TS prefix of a message
+static unsigned int messages_ts(char *buf, const ph_ring_entry_t *e) {
+    unsigned int n = messages_time(buf, e);
+
+    buf[n++] = ' ';
+    return n;
+}
+
+#define messages_is_json(format) \
+    ((format) == PH_FORMAT_JSON || (format) == PH_FORMAT_NDJSON)
+
+// The JSON formats frame the messages themselves, the configured prefix,
+// suffix and delimiter would break them
+static void messages_framing(int format, const char **prefix,
+                             const char **suffix,
+                             const char **line_delimiter) {
+    if (format == PH_FORMAT_JSON) {
+        *prefix = "[";
+        *suffix = "]\n";
+        *line_delimiter = ",";
+    } else if (format == PH_FORMAT_NDJSON) {
+        *prefix = *suffix = *line_delimiter = NULL;
+    }
+}
+
+// Writes what the format puts before message seq to buf, the JSON formats
+// open its object up to the data string
+static unsigned int messages_head(char *buf, const ph_ring_entry_t *e,
+                                  uint64_t seq, int format) {
+    unsigned int n;
+
+    if (format == PH_FORMAT_TS) return messages_ts(buf, e);
+    if (!messages_is_json(format)) return 0;
+
+    memcpy(buf, "{\"seq\":", 7);
+    n = 7 + messages_uint(buf + 7, seq, 1);
+    memcpy(buf + n, ",\"ts\":", 6);
+    n += 6;
+    n += messages_time(buf + n, e);
+    memcpy(buf + n, ",\"data\":\"", 9);
+
+    return n + 9;
+}
+
+// Length of what messages_head() writes, without writing it
+static unsigned int messages_head_len(const ph_ring_entry_t *e, uint64_t seq,
+                                      int format) {
+    // Seconds, the dot and six digits of microseconds
+    unsigned int time = messages_digits(e->wall / 1000000000ULL) + 7;
+
+    if (format == PH_FORMAT_TS) return time + 1;
+    if (!messages_is_json(format)) return 0;
+
+    return 7 + messages_digits(seq) + 6 + time + 9;
+}
+
+// The message bytes the format shows, for JSON the string escaped at ingest
+// or the message itself when it needed no escaping
+static const char *messages_body(const char *data, const ph_ring_entry_t *e,
+                                 int format, unsigned int *len) {
+    *len = e->len;
+    if (!messages_is_json(format)) return data;
+    if (e->json) {
+        *len = e->json;
+        return data + e->len;
+    }
+    if (*len > 0 && data[*len - 1] == '\n') (*len)--;
+
+    return data;
+}
+
+static const char *messages_tail(int format) {
+    if (format == PH_FORMAT_JSON) return "\"}";
+    if (format == PH_FORMAT_NDJSON) return "\"}\n";
+
+    return NULL;
+}
+
+unsigned long int messages_formated_size(const ph_ring_view_t *view,
+                                         const unsigned int lines, int format,
+                                         const char *prefix,
+                                         const char *suffix,
+                                         const char *line_delimiter) {
+    unsigned long int total_messages_size = 0;
+    unsigned int count = messages_count(view, lines);
+    const char *tail = messages_tail(format);
+    unsigned int tail_len = tail ? strlen(tail) : 0;
+    ph_ring_entry_t e;
+    const char *data;
+    unsigned int l, len;
+
+    messages_framing(format, &prefix, &suffix, &line_delimiter);
+    // Message sizes are known so the body size needs no walk over the data,
+    // JSON only looks at the last byte of each message
+    for (l = 0; l < count; l++) {
+        if ((data = ring_view_entry(view, view->last - l, &e))) {
+            messages_body(data, &e, format, &len);
+            total_messages_size +=
+                len + tail_len + messages_head_len(&e, view->last - l, format);
         }
     }
 
     if (prefix) {
-        total_messages_size += prefix_len;
+        total_messages_size += strlen(prefix);
     }
     if (suffix) {
-        total_messages_size += suffix_len;
+        total_messages_size += strlen(suffix);
+    }
+    if (line_delimiter && count > 0) {
+        total_messages_size += strlen(line_delimiter) * (count - 1);
     }
 
     debug_print("Total messages size: %ld\n", total_messages_size);
 
-    char *body = (char *)malloc(total_messages_size + 1);
-    if (!body) {
-        fprintf(stderr, "Cannot alloc memory for messages\n");
-        return NULL;
-    }
-    memset(body, 0, total_messages_size + 1);
+    return total_messages_size;
+}
 
+// Nothing is copied for len 0, src may then be NULL
+static unsigned long int messages_copy(char *body, unsigned long int seek,
+                                       unsigned long int size, const char *src,
+                                       unsigned long int len) {
+    if (len == 0 || seek >= size) return seek;
+    if (len > size - seek) len = size - seek;
+    memcpy(body + seek, src, len);
+    return seek + len;
+}
+
+// Writes at most size bytes, a shorter or longer body than the one measured
+// by messages_formated_size() means the view was invalidated meanwhile
+unsigned long int messages_format(const ph_ring_view_t *view, char *body,
+                                  unsigned long int size,
+                                  const unsigned int lines, int format,
+                                  const char *prefix, const char *suffix,
+                                  const char *line_delimiter) {
+    unsigned int line_delimiter_len = 0;
+    unsigned int count = messages_count(view, lines);
+    const char *tail = messages_tail(format);
+    unsigned int tail_len = tail ? strlen(tail) : 0;
     unsigned long int seek = 0;
+    char head[PH_MESSAGES_HEAD_SIZE];
+    ph_ring_entry_t e;
+    const char *data;
+    unsigned int l, len;
+
+    debug_print("Requested lines: %u\n", lines);
+
+    messages_framing(format, &prefix, &suffix, &line_delimiter);
+    if (line_delimiter) {
+        line_delimiter_len = strlen(line_delimiter);
+    }
 
     if (prefix) {
-        memcpy(body, prefix, prefix_len);
-        seek += strlen(prefix);
-    }
-
-    for (l = 0, e = dlist_head(&messages); e != NULL && l < lines;
-         e = e->next, l++) {
-        if (e->data) {
-            unsigned int len = strlen(e->data);
-            memcpy(body + seek, e->data, len);
-            seek += len;
-            if (line_delimiter && l < lines - 1 && e->next != NULL) {
-                memcpy(body + seek, line_delimiter, line_delimiter_len);
-                seek += line_delimiter_len;
+        seek = messages_copy(body, seek, size, prefix, strlen(prefix));
+    }
+
+    for (l = 0; l < count; l++) {
+        if ((data = ring_view_entry(view, view->last - l, &e))) {
+            if (format != PH_FORMAT_RAW) {
+                seek = messages_copy(
+                    body, seek, size, head,
+                    messages_head(head, &e, view->last - l, format));
             }
+            data = messages_body(data, &e, format, &len);
+            seek = messages_copy(body, seek, size, data, len);
+            if (tail) seek = messages_copy(body, seek, size, tail, tail_len);
+        }
+        if (line_delimiter_len && l < count - 1) {
+            seek = messages_copy(body, seek, size, line_delimiter,
+                                 line_delimiter_len);
         }
     }
 
     if (suffix) {
-        memcpy(body + seek, suffix, suffix_len);
+        seek = messages_copy(body, seek, size, suffix, strlen(suffix));
     }
 
+    return seek;
+}
+
+static char *messages_view_copy(const ph_ring_view_t *view,
+                                const unsigned int lines, int format,
+                                const char *prefix, const char *suffix,
+                                const char *line_delimiter,
+                                unsigned long int *len) {
+    char *body;
+
+    *len = messages_formated_size(view, lines, format, prefix, suffix,
+                                  line_delimiter);
+    if (!(body = (char *)malloc(*len + 1))) {
+        fprintf(stderr, "Cannot alloc memory for messages\n");
+        return NULL;
+    }
+    messages_format(view, body, *len, lines, format, prefix, suffix,
+                    line_delimiter);
+    body[*len] = '\0';
+
+    return body;
+}
+
+// Returns a copy of the formatted body, safe to call from any thread. The copy
+// is repeated if the writer replaced messages while they were being copied.
+char *messages_get_formated(ph_messages_t *messages, const uint64_t since,
+                            const unsigned int lines, int format,
+                            const char *prefix, const char *suffix,
+                            const char *line_delimiter,
+                            unsigned long int *len, ph_ring_range_t *range) {
+    ph_ring_view_t view;
+    char *body = NULL;
+
+    do {
+        free(body);
+        messages_read_begin(messages, &view);
+        messages_view_since(&view, since);
+        messages_view_range(&view, lines, range);
+
+        if (!(body = messages_view_copy(&view, lines, format, prefix, suffix,
+                                        line_delimiter, len))) {
+            ring_read_end(&messages->ring);
+            return NULL;
+        }
+    } while (messages_read_end(messages, &view, range->first) < 0);
+
+    return body;
+}
+
+// Like messages_get_formated() for the messages stored from from to to, see
+// messages_view_time(). The time order lets it skip to them in O(log n).
+char *messages_get_range(ph_messages_t *messages, uint64_t from, uint64_t to,
+                         int format, const char *prefix, const char *suffix,
+                         const char *line_delimiter, unsigned long int *len,
+                         ph_ring_range_t *range) {
+    ph_ring_view_t view;
+    char *body = NULL;
+
+    do {
+        free(body);
+        messages_read_begin(messages, &view);
+        messages_view_time(&view, from, to);
+        messages_view_range(&view, 0, range);
+
+        if (!(body = messages_view_copy(&view, 0, format, prefix, suffix,
+                                        line_delimiter, len))) {
+            ring_read_end(&messages->ring);
+            return NULL;
+        }
+    } while (messages_read_end(messages, &view, range->first) < 0);
+
+    return body;
+}
+
+typedef struct messages_grep_ {
+    const ph_ring_view_t *view;
+    const char *query;
+    unsigned int query_len;
+    uint64_t *seqs;
+    unsigned int count;
+    // Oldest message looked at, the view must still hold it at the end
+    uint64_t oldest;
+} messages_grep_t;
+
+static int messages_grep_match(messages_grep_t *grep, uint64_t seq) {
+    ph_ring_entry_t e;
+    const char *data = ring_view_entry(grep->view, seq, &e);
+
+    if (seq < grep->oldest) grep->oldest = seq;
+    if (!data || !memmem(data, e.len, grep->query, grep->query_len)) return 0;
+    grep->seqs[grep->count++] = seq;
+
+    return 1;
+}
+
+// Newest limit messages holding query formatted like messages_get_formated(),
+// limit 0 means all of them. Uses the trigram index when there is one.
+char *messages_grep(ph_messages_t *messages, const char *query,
+                    unsigned int query_len, const unsigned int limit,
+                    int format, const char *prefix, const char *suffix,
+                    const char *line_delimiter, unsigned long int *len,
+                    ph_ring_range_t *range) {
+    unsigned int delimiter_len, prefix_len, suffix_len, max, i, data_len;
+    const char *tail = messages_tail(format);
+    unsigned int tail_len = tail ? strlen(tail) : 0;
+    ph_trigram_t *index = messages->trigram;
+    messages_grep_t grep = {.query = query, .query_len = query_len};
+    char head[PH_MESSAGES_HEAD_SIZE];
+    ph_ring_view_t view;
+    char *body = NULL;
+    uint64_t *candidates = NULL;
+    int found;
+
+    messages_framing(format, &prefix, &suffix, &line_delimiter);
+    delimiter_len = line_delimiter ? strlen(line_delimiter) : 0;
+    prefix_len = prefix ? strlen(prefix) : 0;
+    suffix_len = suffix ? strlen(suffix) : 0;
+
+    do {
+        free(body);
+        body = NULL;
+        grep.count = 0;
+
+        // The index lock keeps the view and the index at the same message
+        if (index) trigram_read_lock(index);
+        messages_read_begin(messages, &view);
+        grep.view = &view;
+        grep.oldest = view.last + 1;
+
+        max = messages_count(&view, limit);
+        if (!(grep.seqs = (uint64_t *)malloc((max + 1) * sizeof(uint64_t)))) {
+            if (index) trigram_unlock(index);
+            ring_read_end(&messages->ring);
+            return NULL;
+        }
+
+        // Only the candidates are taken under the lock, ingest waits for
+        // no message checks
+        found = index && max > 0
+                    ? trigram_search(index, query, query_len, view.first,
+                                     view.last, &candidates)
+                    : -1;
+        if (index) trigram_unlock(index);
+
+        if (found < 0) {
+            uint64_t seq;
+
+            for (seq = view.last; seq >= view.first && grep.count < max;
+                 seq--) {
+                messages_grep_match(&grep, seq);
+            }
+        }
+        for (i = 0; (int)i < found && grep.count < max; i++) {
+            messages_grep_match(&grep, candidates[i]);
+        }
+        free(candidates);
+        candidates = NULL;
+
+        *len = prefix_len + suffix_len;
+        for (i = 0; i < grep.count; i++) {
+            ph_ring_entry_t e;
+            const char *data = ring_view_entry(&view, grep.seqs[i], &e);
+
+            if (data) {
+                messages_body(data, &e, format, &data_len);
+                *len += data_len + tail_len +
+                        messages_head_len(&e, grep.seqs[i], format);
+            }
+            if (i > 0) *len += delimiter_len;
+        }
+
+        if ((body = (char *)malloc(*len + 1))) {
+            unsigned long int seek = 0;
+
+            seek = messages_copy(body, seek, *len, prefix, prefix_len);
+            for (i = 0; i < grep.count; i++) {
+                ph_ring_entry_t e;
+                const char *data = ring_view_entry(&view, grep.seqs[i], &e);
+
+                if (i > 0) {
+                    seek = messages_copy(body, seek, *len, line_delimiter,
+                                         delimiter_len);
+                }
+                if (!data) continue;
+                seek = messages_copy(
+                    body, seek, *len, head,
+                    messages_head(head, &e, grep.seqs[i], format));
+                data = messages_body(data, &e, format, &data_len);
+                seek = messages_copy(body, seek, *len, data, data_len);
+                seek = messages_copy(body, seek, *len, tail, tail_len);
+            }
+            messages_copy(body, seek, *len, suffix, suffix_len);
+            body[*len] = '\0';
+        }
+        free(grep.seqs);
+    } while (messages_read_end(messages, &view, grep.oldest) < 0);
+
+    if (!body) fprintf(stderr, "Cannot alloc memory for messages\n");
+    range->first = grep.oldest;
+    range->last = view.last;
+
     return body;
-}
\ No newline at end of file
+}
+
+int messages_iov_max(const ph_ring_view_t *view, const unsigned int lines) {
+    return 2 * messages_count(view, lines) + 2;
+}
+
+// Fills iov with prefix, each stored message, delimiters and suffix pointing
+// straight into the message store. The iov array must hold at least
+// messages_iov_max() entries. Only the writer thread may use it, the data is
+// referenced in place and stays valid until the next store change.
+int messages_iov(const ph_ring_view_t *view, struct iovec *iov,
+                 const unsigned int lines, const char *prefix,
+                 const char *suffix, const char *line_delimiter) {
+    unsigned int line_delimiter_len = 0;
+    unsigned int count = messages_count(view, lines);
+    ph_ring_entry_t e;
+    const char *data;
+    unsigned int l;
+    int n = 0;
+
+    if (line_delimiter) {
+        line_delimiter_len = strlen(line_delimiter);
+    }
+
+    if (prefix && *prefix) {
+        iov[n].iov_base = (void *)prefix;
+        iov[n++].iov_len = strlen(prefix);
+    }
+
+    for (l = 0; l < count; l++) {
+        if ((data = ring_view_entry(view, view->last - l, &e))) {
+            iov[n].iov_base = (void *)data;
+            iov[n++].iov_len = e.len;
+        }
+        if (line_delimiter_len && l < count - 1) {
+            iov[n].iov_base = (void *)line_delimiter;
+            iov[n++].iov_len = line_delimiter_len;
+        }
+    }
+
+    if (suffix && *suffix) {
+        iov[n].iov_base = (void *)suffix;
+        iov[n++].iov_len = strlen(suffix);
+    }
+
+    return n;
+}
@@ -7,13 +7,92 @@
 #ifndef __PH_MESSAGES_H
 #define __PH_MESSAGES_H
 
-int messages_init(unsigned int lines);
-void messages_clear(void);
-void messages_resize(unsigned int new_size);
-void message_free(void);
-int message_add_chunk(char *buffer, int len);
-int message_check_save(unsigned int rate, unsigned int output);
-char *messages_get_formated(const unsigned int lines, const char *prefix, const char *suffix, const char *line_delimiter);
-char *message_get_current();
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "ring.h"
+#include "trigram.h"
+
+// Initial input buffer, it only grows for records that don't fit
+#define PH_MESSAGES_INPUT_SIZE (64 * 1024)
+// Room for the text a format puts before a message
+#define PH_MESSAGES_HEAD_SIZE 96
+
+// One message store with its own input buffer and rate limiting state
+typedef struct ph_messages_ {
+    ph_ring_t ring;
+    // Serializes writers (ingest, clear, resize), readers never take it
+    pthread_mutex_t lock;
+    // Unfinished line or block carried over to the next read, complete
+    // lines are stored straight out of what was read
+    char *input;
+    unsigned int input_len;
+    unsigned int input_size;
+    // Bumped on every change of the stored messages, keys the response cache
+    unsigned long int generation;
+    // Wall clock second of the last change, sent as Last-Modified
+    time_t modified;
+    // Token bucket rate limiting, settings from messages_rate() and the
+    // state kept by the writer thread
+    unsigned int rate_interval;
+    unsigned int rate_burst;
+    unsigned int rate_latest;
+    unsigned int rate_tokens;
+    uint64_t rate_refill;
+    // Newest message refused in latest mode, waiting for a token
+    char *pending;
+    unsigned int pending_len;
+    unsigned int pending_size;
+    uint64_t pending_ts;
+    uint64_t pending_wall;
+    // Scratch space the writer thread escapes messages for JSON in
+    char *json;
+    unsigned int json_size;
+    // Ingest counters, written only by the writer thread
+    uint64_t lines_stored;
+    uint64_t bytes_stored;
+    uint64_t lines_dropped;
+    // Messages too big for max_bytes or the store file, never stored
+    uint64_t lines_oversize;
+    // Optional substring index for messages_grep()
+    ph_trigram_t *trigram;
+} ph_messages_t;
+
+#define messages_stat(m, field) __atomic_load_n(&(m)->field, __ATOMIC_RELAXED)
+
+int messages_init(ph_messages_t *messages, unsigned int lines, uint64_t max_bytes, const char *path, uint64_t size);
+void messages_clear(ph_messages_t *messages);
+void messages_resize(ph_messages_t *messages, unsigned int new_size, uint64_t max_bytes);
+void messages_usage(ph_messages_t *messages, unsigned int *lines, uint64_t *bytes, uint64_t *memory);
+uint64_t messages_json_bytes(ph_messages_t *messages);
+int messages_index(ph_messages_t *messages);
+void message_free(ph_messages_t *messages);
+int message_input_data(ph_messages_t *messages, const char *data, unsigned int len, unsigned int output, unsigned int block);
+int message_check_save(ph_messages_t *messages, unsigned int output);
+void message_input_end(ph_messages_t *messages, unsigned int output, unsigned int block);
+void messages_rate(ph_messages_t *messages, unsigned int interval, unsigned int burst, unsigned int latest);
+int messages_flush_pending(ph_messages_t *messages, unsigned int output);
+unsigned long int messages_generation(ph_messages_t *messages);
+void messages_read_begin(ph_messages_t *messages, ph_ring_view_t *view);
+int messages_read_end(ph_messages_t *messages, ph_ring_view_t *view, uint64_t oldest);
+uint64_t messages_view_oldest(const ph_ring_view_t *view, const unsigned int lines);
+uint64_t messages_last_seq(ph_messages_t *messages);
+uint64_t messages_epoch(ph_messages_t *messages);
+time_t messages_modified(ph_messages_t *messages);
+void messages_current_range(ph_messages_t *messages, uint64_t since, const unsigned int lines, ph_ring_range_t *range);
+void messages_view_since(ph_ring_view_t *view, uint64_t since);
+void messages_view_time(ph_ring_view_t *view, uint64_t from, uint64_t to);
+void messages_view_range(const ph_ring_view_t *view, const unsigned int lines, ph_ring_range_t *range);
+int messages_cursor_valid(uint64_t since, const ph_ring_range_t *range);
+unsigned int messages_count(const ph_ring_view_t *view, const unsigned int lines);
+unsigned long int messages_formated_size(const ph_ring_view_t *view, const unsigned int lines, int format, const char *prefix, const char *suffix, const char *line_delimiter);
+unsigned long int messages_format(const ph_ring_view_t *view, char *body, unsigned long int size, const unsigned int lines, int format, const char *prefix, const char *suffix, const char *line_delimiter);
+char *messages_get_formated(ph_messages_t *messages, const uint64_t since, const unsigned int lines, int format, const char *prefix, const char *suffix, const char *line_delimiter, unsigned long int *len, ph_ring_range_t *range);
+char *messages_get_range(ph_messages_t *messages, uint64_t from, uint64_t to, int format, const char *prefix, const char *suffix, const char *line_delimiter, unsigned long int *len, ph_ring_range_t *range);
+char *messages_grep(ph_messages_t *messages, const char *query, unsigned int query_len, const unsigned int limit, int format, const char *prefix, const char *suffix, const char *line_delimiter, unsigned long int *len, ph_ring_range_t *range);
+int messages_iov_max(const ph_ring_view_t *view, const unsigned int lines);
+int messages_iov(const ph_ring_view_t *view, struct iovec *iov, const unsigned int lines, const char *prefix, const char *suffix, const char *line_delimiter);
 
 #endif
\ No newline at end of file
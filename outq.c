@@ -0,0 +1,132 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#include "outq.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+static int outq_grow(ph_outq_t *q) {
+    unsigned int size = q->size ? q->size * 2 : PH_OUTQ_MIN_SEGS;
+    ph_outq_seg_t *segs;
+    unsigned int i;
+
+    if (!(segs = (ph_outq_seg_t *)malloc(size * sizeof(ph_outq_seg_t)))) {
+        fprintf(stderr, "Cannot grow output queue\n");
+        return -1;
+    }
+
+    for (i = 0; i < q->count; i++) {
+        segs[i] = q->segs[(q->head + i) % q->size];
+    }
+
+    free(q->segs);
+    q->segs = segs;
+    q->size = size;
+    q->head = 0;
+
+    return 0;
+}
+
+// Queues a reference to len bytes of buf from off, the caller keeps its own
+// reference
+int outq_push_range(ph_outq_t *q, ph_buf_t *buf, unsigned long int off,
+                    unsigned long int len) {
+    ph_outq_seg_t *seg;
+
+    if (len == 0) return 0;
+
+    if (q->count == q->size && outq_grow(q) < 0) return -1;
+
+    seg = &q->segs[(q->head + q->count) % q->size];
+    seg->buf = buf_ref(buf);
+    seg->off = off;
+    seg->end = off + len;
+    q->count++;
+    q->bytes += len;
+
+    return 0;
+}
+
+int outq_push(ph_outq_t *q, ph_buf_t *buf) {
+    return outq_push_range(q, buf, 0, buf->len);
+}
+
+// Queues a private copy of data, for bytes that don't outlive the call
+int outq_push_copy(ph_outq_t *q, const char *data, unsigned long int len) {
+    ph_buf_t *buf;
+    int rc;
+
+    if (len == 0) return 0;
+
+    if (!(buf = buf_new(len))) return -1;
+    memcpy(buf->data, data, len);
+    rc = outq_push(q, buf);
+    buf_unref(buf);
+
+    return rc;
+}
+
+// Sends as much as the socket takes. Returns 1 when data is left for a later
+// writable event, 0 when the queue is drained or -1 on error.
+int outq_send(ph_outq_t *q, int fd) {
+    struct iovec iov[PH_OUTQ_IOV];
+    struct msghdr msg;
+    ssize_t rc;
+    unsigned int i, n;
+
+    while (q->count > 0) {
+        n = q->count < PH_OUTQ_IOV ? q->count : PH_OUTQ_IOV;
+        for (i = 0; i < n; i++) {
+            ph_outq_seg_t *seg = &q->segs[(q->head + i) % q->size];
+            iov[i].iov_base = seg->buf->data + seg->off;
+            iov[i].iov_len = seg->end - seg->off;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+
+        rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            return -1;
+        }
+        q->bytes -= rc;
+        q->sent += rc;
+
+        while (rc > 0) {
+            ph_outq_seg_t *seg = &q->segs[q->head];
+            unsigned long int left = seg->end - seg->off;
+
+            if ((unsigned long int)rc < left) {
+                seg->off += rc;
+                break;
+            }
+            rc -= left;
+            buf_unref(seg->buf);
+            q->head = (q->head + 1) % q->size;
+            q->count--;
+        }
+    }
+
+    return 0;
+}
+
+void outq_free(ph_outq_t *q) {
+    while (q->count > 0) {
+        buf_unref(q->segs[q->head].buf);
+        q->head = (q->head + 1) % q->size;
+        q->count--;
+    }
+    free(q->segs);
+    memset(q, 0, sizeof(ph_outq_t));
+}
@@ -0,0 +1,44 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_OUTQ_H
+#define __PH_OUTQ_H
+
+#include "buf.h"
+
+#define PH_OUTQ_MIN_SEGS 16
+// Segments handed to a single sendmsg() call
+#define PH_OUTQ_IOV 64
+
+// Bytes off..end of buf are still to be sent
+typedef struct ph_outq_seg_ {
+    ph_buf_t *buf;
+    unsigned long int off;
+    unsigned long int end;
+} ph_outq_seg_t;
+
+// Pending output of a connection, a ring of references to shared buffers
+typedef struct ph_outq_ {
+    ph_outq_seg_t *segs;
+    unsigned int size;
+    unsigned int head;
+    unsigned int count;
+    unsigned long int bytes;
+    // Bytes sent through the queue so far
+    unsigned long int sent;
+} ph_outq_t;
+
+int outq_push(ph_outq_t *q, ph_buf_t *buf);
+int outq_push_range(ph_outq_t *q, ph_buf_t *buf, unsigned long int off,
+                    unsigned long int len);
+int outq_push_copy(ph_outq_t *q, const char *data, unsigned long int len);
+int outq_send(ph_outq_t *q, int fd);
+void outq_free(ph_outq_t *q);
+
+#define outq_empty(q) ((q)->count == 0)
+#define outq_bytes(q) ((q)->bytes)
+
+#endif
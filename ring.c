@@ -0,0 +1,529 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#include "ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+
+static void ring_release_retired(ph_ring_t *ring) {
+    unsigned int i;
+
+    if (ring->retired_count == 0 ||
+        __atomic_load_n(&ring->readers, __ATOMIC_SEQ_CST) > 0) {
+        return;
+    }
+
+    for (i = 0; i < ring->retired_count; i++) {
+        free(ring->retired[i]);
+    }
+    ring->retired_count = 0;
+}
+
+// Memory replaced by the writer may still be read by a view
+static void ring_retire(ph_ring_t *ring, void *ptr) {
+    while (ring->retired_count == PH_RING_MAX_RETIRED) {
+        ring_release_retired(ring);
+        if (ring->retired_count) sched_yield();
+    }
+    ring->retired[ring->retired_count++] = ptr;
+}
+
+static void ring_layout_begin(ph_ring_t *ring) {
+    __atomic_store_n(&ring->layout, ring->layout + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void ring_layout_end(ph_ring_t *ring) {
+    __atomic_store_n(&ring->layout, ring->layout + 1, __ATOMIC_SEQ_CST);
+    ring_release_retired(ring);
+}
+
+// Space of evicted entries must not be reused before readers can see first
+static void ring_set_first(ph_ring_t *ring, uint64_t first) {
+    __atomic_store_n(&ring->first, first, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    if (ring->header) {
+        __atomic_store_n(&ring->header->first, first, __ATOMIC_RELEASE);
+    }
+}
+
+static int ring_index_resize(ph_ring_t *ring, unsigned int size) {
+    ph_ring_entry_t *index;
+    uint64_t s;
+
+    if (size < ring_count(ring)) return -1;
+
+    if (!(index = (ph_ring_entry_t *)malloc(size * sizeof(ph_ring_entry_t)))) {
+        fprintf(stderr, "Cannot allocate ring index\n");
+        return -1;
+    }
+
+    for (s = ring->first; s <= ring->seq; s++) {
+        index[s % size] = ring->index[s % ring->index_size];
+    }
+
+    ring_layout_begin(ring);
+    ring_retire(ring, ring->index);
+    ring->index = index;
+    __atomic_store_n(&ring->index_size, size, __ATOMIC_RELAXED);
+    ring_layout_end(ring);
+
+    return 0;
+}
+
+// Copies live entries, oldest first, to the start of a larger arena
+static int ring_arena_grow(ph_ring_t *ring, uint64_t need) {
+    uint64_t size = ring->arena_size * 2;
+    uint64_t seek = 0;
+    unsigned int n;
+    char *arena;
+
+    while (size < ring->bytes + ring->json_bytes + need) size *= 2;
+
+    debug_print("Ring arena grow: %lu bytes\n", (unsigned long)size);
+
+    if (!(arena = (char *)malloc(size))) {
+        fprintf(stderr, "Cannot allocate %lu bytes for ring arena\n",
+                (unsigned long)size);
+        return -1;
+    }
+
+    ring_layout_begin(ring);
+    for (n = ring_count(ring); n > 0; n--) {
+        ph_ring_entry_t *e = ring_entry(ring, n - 1);
+        memcpy(arena + seek, ring->arena + e->off, ring_entry_size(e));
+        e->off = seek;
+        seek += ring_entry_size(e);
+    }
+
+    ring_retire(ring, ring->arena);
+    ring->arena = arena;
+    __atomic_store_n(&ring->arena_size, size, __ATOMIC_RELAXED);
+    ring->arena_head = seek;
+    ring_layout_end(ring);
+
+    return 0;
+}
+
+// Returns the arena offset where len contiguous bytes can be written or -1
+static int64_t ring_arena_place(ph_ring_t *ring, uint64_t len) {
+    uint64_t tail;
+
+    if (ring_count(ring) == 0) {
+        ring->arena_head = 0;
+        return len <= ring->arena_size ? 0 : -1;
+    }
+
+    tail = ring_oldest(ring)->off;
+
+    if (ring->arena_head > tail) {
+        if (ring->arena_head + len <= ring->arena_size) return ring->arena_head;
+        // Wrap around, the unused space at the arena end is skipped
+        if (len <= tail) return 0;
+        return -1;
+    }
+
+    if (ring->arena_head + len <= tail) return ring->arena_head;
+
+    return -1;
+}
+
+static uint64_t ring_new_epoch(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return ((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec) ^
+           ((uint64_t)getpid() << 40);
+}
+
+int ring_init(ph_ring_t *ring, unsigned int max_lines) {
+    unsigned int index_size = max_lines > 0 ? max_lines : PH_RING_MIN_INDEX;
+    uint64_t arena_size = (uint64_t)index_size * PH_RING_LINE_BYTES;
+
+    memset(ring, 0, sizeof(ph_ring_t));
+
+    if (arena_size < PH_RING_MIN_ARENA) arena_size = PH_RING_MIN_ARENA;
+
+    ring->index = (ph_ring_entry_t *)malloc(index_size * sizeof(ph_ring_entry_t));
+    ring->arena = (char *)malloc(arena_size);
+
+    if (!ring->index || !ring->arena) {
+        fprintf(stderr, "Cannot allocate ring buffer\n");
+        ring_free(ring);
+        return -1;
+    }
+
+    ring->index_size = index_size;
+    ring->arena_size = arena_size;
+    ring->max_lines = max_lines;
+    ring->first = 1;
+    ring->epoch = ring_new_epoch();
+
+    return 0;
+}
+
+static uint64_t ring_file_index_bytes(unsigned int index_size) {
+    uint64_t bytes = (uint64_t)index_size * sizeof(ph_ring_entry_t);
+
+    return (bytes + PH_RING_FILE_HEADER - 1) &
+           ~(uint64_t)(PH_RING_FILE_HEADER - 1);
+}
+
+static uint64_t ring_file_size(unsigned int index_size, uint64_t arena_size) {
+    return PH_RING_FILE_HEADER + ring_file_index_bytes(index_size) + arena_size;
+}
+
+// Picks up the entries a previous run left. Entries are checked newest first
+// and a broken one drops everything older.
+static void ring_file_load(ph_ring_t *ring) {
+    ph_ring_header_t *header = ring->header;
+    uint64_t first = header->first, seq = header->seq, s;
+
+    if (first == 0 || first > seq + 1 || seq + 1 - first > ring->index_size) {
+        first = seq + 1;
+    }
+
+    for (s = seq; s >= first; s--) {
+        ph_ring_entry_t *e = &ring->index[s % ring->index_size];
+
+        if (e->seq != s || e->len == 0 || e->off > ring->arena_size ||
+            ring_entry_size(e) > ring->arena_size - e->off) {
+            break;
+        }
+        ring->bytes += e->len;
+        ring->json_bytes += e->json;
+    }
+
+    ring->seq = seq;
+    ring->first = s + 1;
+    header->first = s + 1;
+
+    if (ring_count(ring) > 0) {
+        ring->arena_head =
+            ring_entry(ring, 0)->off + ring_entry_size(ring_entry(ring, 0));
+    }
+
+    debug_print("Ring file loaded: %u entries, sequence %lu\n",
+                ring_count(ring), (unsigned long)seq);
+}
+
+// Maps the ring from path. A new file gets index and arena sizes from
+// max_lines and arena_size, an existing store keeps its own and is served
+// again as it was left.
+int ring_init_file(ph_ring_t *ring, const char *path, unsigned int max_lines,
+                   uint64_t arena_size) {
+    unsigned int index_size =
+        max_lines > 0 ? max_lines : arena_size / PH_RING_LINE_BYTES;
+    ph_ring_header_t *header;
+    struct stat st;
+    uint64_t size;
+    void *map;
+    int fd, load = 0;
+
+    memset(ring, 0, sizeof(ph_ring_t));
+
+    if (index_size < PH_RING_MIN_INDEX) index_size = PH_RING_MIN_INDEX;
+    if (arena_size < PH_RING_MIN_ARENA) arena_size = PH_RING_MIN_ARENA;
+
+    if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0 ||
+        fstat(fd, &st) < 0) {
+        fprintf(stderr, "Cannot open ring file %s: %s\n", path,
+                strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    if (st.st_size >= (off_t)sizeof(ph_ring_header_t)) {
+        ph_ring_header_t existing;
+
+        if (pread(fd, &existing, sizeof(existing), 0) !=
+            (ssize_t)sizeof(existing)) {
+            existing.magic[0] = '\0';
+        }
+        if (memcmp(existing.magic, PH_RING_FILE_MAGIC,
+                   sizeof(existing.magic)) == 0) {
+            if (existing.version != PH_RING_FILE_VERSION ||
+                (uint64_t)st.st_size !=
+                    ring_file_size(existing.index_size, existing.arena_size)) {
+                fprintf(stderr, "Ring file %s has an unknown layout\n", path);
+                close(fd);
+                return -1;
+            }
+            index_size = existing.index_size;
+            arena_size = existing.arena_size;
+            load = 1;
+        } else if (existing.magic[0] != '\0') {
+            fprintf(stderr, "%s is not a ph ring file\n", path);
+            close(fd);
+            return -1;
+        }
+    }
+
+    size = ring_file_size(index_size, arena_size);
+    if (!load && ftruncate(fd, size) < 0) {
+        fprintf(stderr, "Cannot size ring file %s: %s\n", path,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Cannot map ring file %s: %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+
+    header = (ph_ring_header_t *)map;
+    ring->header = header;
+    ring->map_size = size;
+    ring->index = (ph_ring_entry_t *)((char *)map + PH_RING_FILE_HEADER);
+    ring->index_size = index_size;
+    ring->arena = (char *)ring->index + ring_file_index_bytes(index_size);
+    ring->arena_size = arena_size;
+    ring->max_lines = max_lines;
+
+    if (load) {
+        ring_file_load(ring);
+        if (header->epoch == 0) header->epoch = ring_new_epoch();
+    } else {
+        header->version = PH_RING_FILE_VERSION;
+        header->index_size = index_size;
+        header->arena_size = arena_size;
+        header->first = 1;
+        header->seq = 0;
+        header->epoch = ring_new_epoch();
+        // The magic goes last, a half written header reads as a new file
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(header->magic, PH_RING_FILE_MAGIC, sizeof(header->magic));
+        ring->first = 1;
+    }
+    ring->epoch = header->epoch;
+
+    while (max_lines > 0 && ring_count(ring) > max_lines) {
+        ring_evict(ring);
+    }
+
+    return 0;
+}
+
+void ring_free(ph_ring_t *ring) {
+    unsigned int i;
+
+    for (i = 0; i < ring->retired_count; i++) {
+        free(ring->retired[i]);
+    }
+    if (ring->header) {
+        munmap(ring->header, ring->map_size);
+    } else {
+        free(ring->index);
+        free(ring->arena);
+    }
+    memset(ring, 0, sizeof(ph_ring_t));
+}
+
+void ring_clear(ph_ring_t *ring) {
+    ring_set_first(ring, ring->seq + 1);
+    __atomic_store_n(&ring->bytes, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->json_bytes, 0, __ATOMIC_RELAXED);
+    ring->arena_head = 0;
+}
+
+// A limit of 0 means unlimited
+int ring_resize(ph_ring_t *ring, unsigned int max_lines, uint64_t max_bytes) {
+    ring->max_lines = max_lines;
+    ring->max_bytes = max_bytes;
+
+    while (max_bytes > 0 && ring->bytes > max_bytes) {
+        ring_evict(ring);
+    }
+
+    if (max_lines == 0) return 0;
+
+    while (ring_count(ring) > max_lines) {
+        ring_evict(ring);
+    }
+
+    // A file backed index keeps its size, it caps max_lines instead
+    if (ring_fixed(ring) || max_lines == ring->index_size) return 0;
+
+    return ring_index_resize(ring, max_lines);
+}
+
+void ring_evict(ph_ring_t *ring) {
+    if (ring_count(ring) == 0) return;
+
+    __atomic_store_n(&ring->bytes, ring->bytes - ring_oldest(ring)->len,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->json_bytes,
+                     ring->json_bytes - ring_oldest(ring)->json,
+                     __ATOMIC_RELAXED);
+    ring_set_first(ring, ring->first + 1);
+}
+
+// Stores a message and, when it has one, its JSON escaped copy. Returns
+// PH_RING_OVERSIZE for a message over max_bytes or the file arena.
+int ring_insert(ph_ring_t *ring, const char *data, uint32_t len,
+                const char *json, uint32_t json_len, uint64_t ts,
+                uint64_t wall) {
+    uint64_t size = (uint64_t)len + json_len;
+    ph_ring_entry_t *e;
+    int64_t at;
+
+    if (len == 0) return -1;
+
+    // Evicting can never make room for a message over the byte limit. Only
+    // the message counts, not its escaped copy.
+    if (ring->max_bytes > 0) {
+        if (len > ring->max_bytes) return PH_RING_OVERSIZE;
+
+        while (ring->bytes + len > ring->max_bytes) {
+            ring_evict(ring);
+        }
+    }
+
+    if (ring->max_lines > 0) {
+        while (ring_count(ring) >= ring->max_lines) {
+            ring_evict(ring);
+        }
+    }
+
+    if (ring_fixed(ring)) {
+        if (size > ring->arena_size) return PH_RING_OVERSIZE;
+
+        if (ring_count(ring) == ring->index_size) ring_evict(ring);
+        // Fixed size, the oldest entries make room
+        while ((at = ring_arena_place(ring, size)) < 0) {
+            ring_evict(ring);
+        }
+    } else {
+        if (ring_count(ring) == ring->index_size &&
+            ring_index_resize(ring, ring->index_size * 2) < 0) {
+            return -1;
+        }
+
+        if ((at = ring_arena_place(ring, size)) < 0) {
+            if (ring_arena_grow(ring, size) < 0) return -1;
+            at = ring_arena_place(ring, size);
+        }
+    }
+
+    // A clock stepped back keeps the entries in time order for
+    // ring_view_find()
+    if (ring_count(ring) > 0 && ring_entry(ring, 0)->wall > wall) {
+        wall = ring_entry(ring, 0)->wall;
+    }
+
+    memcpy(ring->arena + at, data, len);
+    if (json_len) memcpy(ring->arena + at + len, json, json_len);
+
+    e = &ring->index[(ring->seq + 1) % ring->index_size];
+    e->off = at;
+    e->len = len;
+    e->json = json_len;
+    e->seq = ring->seq + 1;
+    e->ts = ts;
+    e->wall = wall;
+
+    __atomic_store_n(&ring->bytes, ring->bytes + len, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->json_bytes, ring->json_bytes + json_len,
+                     __ATOMIC_RELAXED);
+    ring->arena_head = at + size;
+    // Entry and data are complete before the sequence makes them visible
+    __atomic_store_n(&ring->seq, ring->seq + 1, __ATOMIC_RELEASE);
+    if (ring->header) {
+        __atomic_store_n(&ring->header->seq, ring->seq, __ATOMIC_RELEASE);
+    }
+    ring_release_retired(ring);
+
+    return 0;
+}
+
+// Takes a consistent picture of the ring pointers and live range. The view
+// stays safe to read until ring_read_end() even if the writer moves entries.
+void ring_read_begin(ph_ring_t *ring, ph_ring_view_t *view) {
+    __atomic_add_fetch(&ring->readers, 1, __ATOMIC_SEQ_CST);
+
+    do {
+        while ((view->layout = __atomic_load_n(&ring->layout,
+                                               __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+        }
+        view->arena = ring->arena;
+        view->arena_size = ring->arena_size;
+        view->index = ring->index;
+        view->index_size = ring->index_size;
+        view->last = __atomic_load_n(&ring->seq, __ATOMIC_ACQUIRE);
+        view->first = __atomic_load_n(&ring->first, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&ring->layout, __ATOMIC_RELAXED) != view->layout);
+
+    if (view->first > view->last + 1) view->first = view->last + 1;
+    // Slots older than one index turn are reused already
+    if (view->last - view->first + 1 > view->index_size) {
+        view->first = view->last + 1 - view->index_size;
+    }
+}
+
+void ring_read_end(ph_ring_t *ring) {
+    __atomic_sub_fetch(&ring->readers, 1, __ATOMIC_SEQ_CST);
+}
+
+// Copies the entry for seq and returns its data, or NULL when the slot
+// doesn't hold seq anymore or points outside the arena
+const char *ring_view_entry(const ph_ring_view_t *view, uint64_t seq,
+                            ph_ring_entry_t *entry) {
+    *entry = view->index[seq % view->index_size];
+
+    if (entry->seq != seq || entry->off > view->arena_size ||
+        ring_entry_size(entry) > view->arena_size - entry->off) {
+        return NULL;
+    }
+
+    return view->arena + entry->off;
+}
+
+// True when data read through the view for entries from oldest onward
+// wasn't evicted or moved by the writer
+int ring_view_valid(ph_ring_t *ring, const ph_ring_view_t *view,
+                    uint64_t oldest) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&ring->layout, __ATOMIC_RELAXED) == view->layout &&
+           __atomic_load_n(&ring->first, __ATOMIC_RELAXED) <= oldest;
+}
+
+// First sequence of the view whose entry has a wall time of at least wall,
+// view->last + 1 when there is none. Entries evicted meanwhile count as
+// older, eviction always takes the oldest ones.
+uint64_t ring_view_find(const ph_ring_view_t *view, uint64_t wall) {
+    uint64_t low = view->first, high = view->last + 1;
+    ph_ring_entry_t e;
+
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+
+        if (!ring_view_entry(view, mid, &e) || e.wall < wall) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
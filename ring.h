@@ -0,0 +1,142 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_RING_H
+#define __PH_RING_H
+
+#include <stdint.h>
+
+// Initial arena bytes reserved per line, the arena grows by doubling
+#define PH_RING_LINE_BYTES 128
+#define PH_RING_MIN_ARENA 4096
+#define PH_RING_MIN_INDEX 64
+#define PH_RING_MAX_RETIRED 64
+#define PH_RING_FILE_MAGIC "PHRING1"
+#define PH_RING_FILE_VERSION 3
+// Header page of a file backed ring, the index and arena follow it
+#define PH_RING_FILE_HEADER 4096
+// ring_insert() result for a message that can never fit
+#define PH_RING_OVERSIZE -2
+
+// Ingest time in nanoseconds, ts from CLOCK_MONOTONIC and wall from
+// CLOCK_REALTIME. Wall never goes back from one entry to the next. json is
+// the length of the JSON escaped copy stored after the data, 0 when the data
+// needs no escaping.
+typedef struct ph_ring_entry_ {
+    uint64_t off;
+    uint32_t len;
+    uint32_t json;
+    uint64_t seq;
+    uint64_t ts;
+    uint64_t wall;
+} ph_ring_entry_t;
+
+// Only first and seq change once a file is set up. Each is stored after the
+// data it covers so a crash leaves a header describing complete entries.
+typedef struct ph_ring_header_ {
+    char magic[8];
+    uint32_t version;
+    uint32_t index_size;
+    uint64_t arena_size;
+    uint64_t first;
+    uint64_t seq;
+    // Identifies the store across restarts, 0 in files from before it
+    uint64_t epoch;
+} ph_ring_header_t;
+
+/*
+ * Single writer, lock-free readers. Entry with sequence s lives in index slot
+ * s % index_size and the live entries are first..seq. The writer publishes
+ * eviction by advancing first before reusing any space and bumps layout
+ * (odd while in progress) when entries move. Readers copy what they need
+ * through a ph_ring_view_t and check with ring_view_valid() that nothing they
+ * copied was evicted or moved meanwhile. Memory replaced while readers are
+ * active is released only once they are gone.
+ *
+ * A file backed ring has a fixed index and arena mapped from the file and
+ * evicts old entries to make room instead of growing.
+ */
+typedef struct ph_ring_ {
+    char *arena;
+    uint64_t arena_size;
+    uint64_t arena_head;
+    ph_ring_entry_t *index;
+    unsigned int index_size;
+    unsigned int max_lines;
+    uint64_t max_bytes;
+    // Message bytes, the ones max_bytes limits
+    uint64_t bytes;
+    // Escaped copies, they take arena space but don't count against
+    // max_bytes
+    uint64_t json_bytes;
+    uint64_t seq;
+    uint64_t first;
+    uint64_t layout;
+    int readers;
+    unsigned int retired_count;
+    void *retired[PH_RING_MAX_RETIRED];
+    ph_ring_header_t *header;
+    uint64_t map_size;
+    // Differs for every store, sequence numbers only name a message within
+    // one. A file keeps it so its messages keep their names.
+    uint64_t epoch;
+} ph_ring_t;
+
+typedef struct ph_ring_view_ {
+    uint64_t layout;
+    const char *arena;
+    uint64_t arena_size;
+    const ph_ring_entry_t *index;
+    unsigned int index_size;
+    uint64_t first;
+    uint64_t last;
+} ph_ring_view_t;
+
+// Sequence numbers of the oldest and newest message in a response, first is
+// last + 1 when there are none
+typedef struct ph_ring_range_ {
+    uint64_t first;
+    uint64_t last;
+} ph_ring_range_t;
+
+int ring_init(ph_ring_t *ring, unsigned int max_lines);
+int ring_init_file(ph_ring_t *ring, const char *path, unsigned int max_lines,
+                   uint64_t arena_size);
+void ring_free(ph_ring_t *ring);
+void ring_clear(ph_ring_t *ring);
+int ring_resize(ph_ring_t *ring, unsigned int max_lines, uint64_t max_bytes);
+int ring_insert(ph_ring_t *ring, const char *data, uint32_t len,
+                const char *json, uint32_t json_len, uint64_t ts,
+                uint64_t wall);
+void ring_evict(ph_ring_t *ring);
+
+void ring_read_begin(ph_ring_t *ring, ph_ring_view_t *view);
+void ring_read_end(ph_ring_t *ring);
+const char *ring_view_entry(const ph_ring_view_t *view, uint64_t seq,
+                            ph_ring_entry_t *entry);
+int ring_view_valid(ph_ring_t *ring, const ph_ring_view_t *view,
+                    uint64_t oldest);
+uint64_t ring_view_find(const ph_ring_view_t *view, uint64_t wall);
+
+// Writer side accessors, n = 0 is the newest entry, n = count - 1 the oldest
+#define ring_count(ring) ((unsigned int)((ring)->seq + 1 - (ring)->first))
+#define ring_bytes(ring) ((ring)->bytes)
+// Memory held for entries, safe to read from any thread
+#define ring_memory(ring)                                            \
+    (__atomic_load_n(&(ring)->arena_size, __ATOMIC_RELAXED) +        \
+     __atomic_load_n(&(ring)->index_size, __ATOMIC_RELAXED) *        \
+         sizeof(ph_ring_entry_t))
+#define ring_entry(ring, n) (&(ring)->index[((ring)->seq - (n)) % (ring)->index_size])
+#define ring_oldest(ring) (&(ring)->index[(ring)->first % (ring)->index_size])
+#define ring_data(ring, e) ((ring)->arena + (e)->off)
+// Arena bytes of an entry, its data and the escaped copy
+#define ring_entry_size(e) ((uint64_t)(e)->len + (e)->json)
+
+#define ring_fixed(ring) ((ring)->header != NULL)
+
+#define ring_view_count(view) ((unsigned int)((view)->last + 1 - (view)->first))
+
+#endif
@@ -4,19 +4,34 @@
  *    The MIT License (MIT)
  * 
  */
+#define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <limits.h>
+#include <linux/sockios.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 
 #include "server.h"
 
+#include "cache.h"
+#include "channel.h"
+#include "debug.h"
+#include "follow.h"
+#include "http.h"
+#include "ingest.h"
+#include "messages.h"
+
 int server_setup_socket(ph_config_t *config)
 {
     int server_fd, flags;
@@ -33,8 +48,8 @@ int server_setup_socket(ph_config_t *config)
         return PH_SERVER_ERROR_SOCKET;
     }
 
-    flags = fcntl(server_fd, F_GETFD, 0);
-    if (fcntl(server_fd, F_SETFD, flags | O_NONBLOCK))
+    flags = fcntl(server_fd, F_GETFL, 0);
+    if (fcntl(server_fd, F_SETFL, flags | O_NONBLOCK))
     {
         close(server_fd);
         return PH_SERVER_ERROR_FCNTL;
@@ -47,6 +62,15 @@ int server_setup_socket(ph_config_t *config)
         return PH_SERVER_ERROR_SETSOCKOPT;
     }
 
+    // Every worker binds its own listener, the kernel spreads connections
+    if (config->workers > 0 &&
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse,
+                   sizeof(reuse)) < 0)
+    {
+        close(server_fd);
+        return PH_SERVER_ERROR_SETSOCKOPT;
+    }
+
     addr.sin_family = AF_INET;
     addr.sin_port = htons(config->port);
 
@@ -71,6 +95,1100 @@ int server_setup_socket(ph_config_t *config)
     return server_fd;
 }
 
+// Sends as much of the iovec list as the socket takes without blocking.
+// Sent data is consumed from the list, entries fully sent get a zero length.
+// Returns bytes sent or -1 on error.
+long int server_send_iov(int fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    long int total = 0;
+    ssize_t rc;
+
+    while (iovcnt > 0)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+
+        rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        total += rc;
+
+        // Skip fully sent buffers and move into the partially sent one
+        while (iovcnt > 0 && (size_t)rc >= iov->iov_len)
+        {
+            rc -= iov->iov_len;
+            iov->iov_len = 0;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return total;
+}
+
+// Last time any server handled an event, in CLOCK_MONOTONIC seconds
+static long int server_last_activity = 0;
+
+// Raise the soft descriptor limit so the client cap can actually be reached
+static void server_raise_nofile(unsigned int max_clients)
+{
+    struct rlimit rl;
+    rlim_t need = (rlim_t)max_clients + PH_SERVER_RESERVED_FDS;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= need)
+        return;
+
+    rl.rlim_cur = (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < need)
+                      ? rl.rlim_max
+                      : need;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+        perror("setrlimit() error");
+    debug_print("Descriptor limit: %lu\n", (unsigned long)rl.rlim_cur);
+}
+
+static void server_touch(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    // Avoid bouncing the shared cache line between workers on every wakeup
+    if (__atomic_load_n(&server_last_activity, __ATOMIC_RELAXED) != ts.tv_sec)
+        __atomic_store_n(&server_last_activity, ts.tv_sec, __ATOMIC_RELAXED);
+}
+
+static int server_register(ph_server_t *server, int fd, int type)
+{
+    if (!conn_add(&server->conns, fd, type))
+        return -1;
+
+    if (event_add(&server->loop, fd, PH_EVENT_IN) < 0)
+    {
+        perror("epoll_ctl() error");
+        conn_remove(&server->conns, fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+// A server without listen_fd only handles inputs. The writer server owns the
+// message store and may send responses straight out of it.
+int server_init(ph_server_t *server, ph_config_t *config, int listen_fd,
+                int writer)
+{
+    memset(server, 0, sizeof(ph_server_t));
+    server->config = config;
+    server->listen_fd = listen_fd;
+    server->writer = writer;
+    server->notify_fd = -1;
+
+    server_raise_nofile(config->max_clients);
+    server_touch();
+    server->now = timer_now_ms();
+    timer_wheel_init(&server->timers, server->now);
+
+    if (event_init(&server->loop, PH_SERVER_MAX_EVENTS) < 0)
+        return -1;
+
+    if (conn_table_init(&server->conns) < 0)
+    {
+        event_free(&server->loop);
+        return -1;
+    }
+
+    if (!(server->follow = (ph_server_follow_t *)calloc(
+              channels_count(), sizeof(ph_server_follow_t))))
+    {
+        fprintf(stderr, "Cannot allocate followers\n");
+        server_free(server);
+        return -1;
+    }
+
+    if ((server->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+        server_register(server, server->notify_fd, PH_CONN_NOTIFY) < 0)
+    {
+        perror("eventfd() error");
+        server_free(server);
+        return -1;
+    }
+
+    if (listen_fd >= 0 &&
+        server_register(server, listen_fd, PH_CONN_LISTEN) < 0)
+    {
+        server_free(server);
+        return -1;
+    }
+
+    follow_register(server);
+    stats_register(&server->stats);
+
+    return 0;
+}
+
+// Wakes the server loop, safe to call from other threads
+void server_notify(ph_server_t *server)
+{
+    uint64_t one = 1;
+
+    if (write(server->notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write() error");
+}
+
+void server_stop(ph_server_t *server)
+{
+    __atomic_store_n(&server->shutdown, 1, __ATOMIC_RELEASE);
+    server_notify(server);
+}
+
+static void server_read_notify(ph_server_t *server, ph_conn_t *conn)
+{
+    uint64_t value;
+
+    while (read(conn->fd, &value, sizeof(value)) > 0)
+        ;
+
+    // The ingest thread wakes the writer when it queued reads
+    if (server->writer && ingest_drain() > 0)
+        follow_notify(server);
+    if (__atomic_exchange_n(&server->follow_pending, 0, __ATOMIC_ACQ_REL))
+        follow_dispatch(server);
+}
+
+void server_free(ph_server_t *server)
+{
+    unsigned int i;
+
+    follow_unregister(server);
+    stats_unregister(&server->stats);
+
+    for (i = 0; i < server->conns.size; i++)
+    {
+        ph_conn_t *conn = server->conns.conns[i];
+        if (conn)
+            close(conn->fd);
+    }
+    server->notify_fd = -1;
+    conn_table_free(&server->conns);
+    event_free(&server->loop);
+    free(server->follow);
+    server->follow = NULL;
+}
+
+void server_close(ph_server_t *server, ph_conn_t *conn)
+{
+    int fd = conn->fd;
+
+    debug_print("  Closing connection - %d\n", fd);
+    follow_stop(server, conn);
+    timer_cancel(&server->timers, &conn->timer);
+    event_del(&server->loop, fd);
+    conn_remove(&server->conns, fd);
+    close(fd);
+    stats_add(&server->stats, closed, 1);
+}
+
+// Output bytes the client took, what is still in the socket buffer doesn't
+// count as a slow client can sit on megabytes of it
+static unsigned long int server_delivered(ph_conn_t *conn)
+{
+    int unsent = 0;
+
+    if (ioctl(conn->fd, SIOCOUTQ, &unsent) < 0)
+        unsent = 0;
+
+    return conn->out.sent - unsent;
+}
+
+// Sets the timeout that applies to conn now. Queued output has to make
+// progress, a request has to arrive within the time it started with and a
+// connection without one may only wait so long. Followers only get the write
+// timeout.
+void server_deadline(ph_server_t *server, ph_conn_t *conn)
+{
+    ph_config_t *config = server->config;
+    int deadline = PH_DEADLINE_NONE;
+    unsigned int timeout = 0;
+
+    if (!outq_empty(&conn->out))
+    {
+        deadline = PH_DEADLINE_WRITE;
+        timeout = config->write_timeout;
+    }
+    else if (conn->in_len > 0 && !conn->follow)
+    {
+        deadline = PH_DEADLINE_REQUEST;
+        timeout = config->request_timeout;
+    }
+    else if (!conn->follow)
+    {
+        deadline = PH_DEADLINE_IDLE;
+        timeout = config->idle_timeout;
+    }
+
+    if (timeout == 0)
+    {
+        timer_cancel(&server->timers, &conn->timer);
+        conn->deadline = PH_DEADLINE_NONE;
+        return;
+    }
+
+    // Progress of the output is only looked at when the time is up
+    if (deadline == conn->deadline && deadline != PH_DEADLINE_IDLE &&
+        timer_pending(&conn->timer))
+        return;
+
+    conn->deadline = deadline;
+    if (deadline == PH_DEADLINE_WRITE)
+        conn->deadline_sent = server_delivered(conn);
+    timer_set(&server->timers, &conn->timer, server->now + timeout);
+}
+
+// Closes the connections whose timeout passed
+static void server_expire(ph_server_t *server)
+{
+    ph_timer_t *timer;
+
+    timer_advance(&server->timers, server->now);
+    while ((timer = timer_expired(&server->timers)))
+    {
+        ph_conn_t *conn = (ph_conn_t *)timer->arg;
+        unsigned long int delivered;
+
+        // Still reading, only slower than the socket buffer drains
+        if (conn->deadline == PH_DEADLINE_WRITE &&
+            (delivered = server_delivered(conn)) != conn->deadline_sent)
+        {
+            conn->deadline_sent = delivered;
+            timer_set(&server->timers, &conn->timer,
+                      server->now + server->config->write_timeout);
+            continue;
+        }
+
+        debug_print("  Connection timed out - %d, deadline %d\n", conn->fd,
+                    conn->deadline);
+        stats_add(&server->stats, timed_out, 1);
+        server_close(server, conn);
+    }
+}
+
+// Writable events are only asked for while output is queued, edge triggered
+// they would otherwise come after every send
+static int server_want_write(ph_server_t *server, ph_conn_t *conn, int on)
+{
+    if (conn->want_write == on)
+        return 0;
+
+    if (event_mod(&server->loop, conn->fd,
+                  PH_EVENT_IN | (on ? PH_EVENT_OUT : 0)) < 0)
+    {
+        perror("epoll_ctl() error");
+        return -1;
+    }
+    conn->want_write = on;
+
+    return 0;
+}
+
+// Closes the connection once the queued output is sent
+static void server_finish(ph_server_t *server, ph_conn_t *conn)
+{
+    if (outq_empty(&conn->out) || server_want_write(server, conn, 1) < 0)
+    {
+        server_close(server, conn);
+        return;
+    }
+    conn->closing = 1;
+}
+
+// Sends a response as far as the socket takes it and queues the rest. Parts
+// within body are queued by reference, anything else is copied as it may not
+// outlive the call. Returns the response length or -1 on error.
+static long int server_write(ph_server_t *server, ph_conn_t *conn,
+                             struct iovec *iov, int iovcnt, ph_buf_t *body)
+{
+    long int total = 0;
+    int i, rc = 0;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].iov_len;
+
+    // Requests are only handled with nothing queued, this keeps the order
+    if (server_send_iov(conn->fd, iov, iovcnt) < 0)
+        return -1;
+
+    for (i = 0; i < iovcnt && rc == 0; i++)
+    {
+        char *base = (char *)iov[i].iov_base;
+
+        if (body && base >= body->data && base < body->data + body->len)
+            rc = outq_push_range(&conn->out, body, base - body->data,
+                                 iov[i].iov_len);
+        else
+            rc = outq_push_copy(&conn->out, base, iov[i].iov_len);
+    }
+    if (rc < 0 ||
+        (!outq_empty(&conn->out) && server_want_write(server, conn, 1) < 0))
+        return -1;
+
+    return total;
+}
+
+// Takes a connection accept() returned
+static void server_accept_fd(ph_server_t *server, int fd)
+{
+    ph_conn_t *conn;
+
+    if (server->conns.clients >= server->config->max_clients)
+    {
+        debug_print("  Client limit reached, rejecting - %d\n", fd);
+        send(fd, HTTP_BUSY_RESPONSE, strlen(HTTP_BUSY_RESPONSE),
+             MSG_NOSIGNAL);
+        close(fd);
+        return;
+    }
+
+    if (!(conn = conn_add(&server->conns, fd, PH_CONN_CLIENT)))
+    {
+        close(fd);
+        return;
+    }
+
+    if (event_add(&server->loop, fd, PH_EVENT_IN) < 0)
+    {
+        perror("epoll_ctl() error");
+        conn_remove(&server->conns, fd);
+        close(fd);
+        return;
+    }
+    debug_print("  Incoming connection - %d\n", fd);
+    stats_add(&server->stats, accepted, 1);
+    server_deadline(server, conn);
+}
+
+static void server_accept(ph_server_t *server)
+{
+    int fd;
+
+    while (1)
+    {
+        fd = accept4(server->listen_fd, NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept() error");
+            break;
+        }
+        server_accept_fd(server, fd);
+    }
+}
+
+// Strips a /ch/<name> prefix from the request path, without one the request
+// is for stdin. Returns NULL for unknown channels.
+static ph_channel_t *server_request_channel(ph_http_request_t *req)
+{
+    char name[PH_CONFIG_MAX_CHANNEL_NAME];
+    int rc = http_request_channel(req, name, sizeof(name));
+
+    if (rc < 0)
+        return NULL;
+
+    return rc > 0 ? channel_find(name) : channel_get(0);
+}
+
+// Compressed copy of the body for key, made from the cached plain body when
+// there is one. The result is owned by the cache.
+static ph_buf_t *server_compress_body(ph_messages_t *messages,
+                                      const ph_cache_key_t *key,
+                                      unsigned long int generation,
+                                      ph_ring_range_t *range)
+{
+    ph_cache_key_t plain_key = *key;
+    ph_buf_t *plain, *buf;
+    const char *data;
+    char *body = NULL, *compressed;
+    unsigned long int plain_len, len;
+    int seen;
+
+    plain_key.encoding = PH_ENCODING_IDENTITY;
+    if ((plain = cache_get(&plain_key, generation, range, &seen)))
+    {
+        data = plain->data;
+        plain_len = plain->len;
+    }
+    else
+    {
+        body = messages_get_formated(messages, key->since, key->lines,
+                                     key->format, key->prefix, key->suffix,
+                                     key->line_delimiter, &plain_len, range);
+        if (!body)
+            return NULL;
+        data = body;
+    }
+
+    compressed = gzip_compress(data, plain_len, key->encoding, &len);
+    free(body);
+    if (!compressed || !(buf = buf_wrap(compressed, len)))
+        return NULL;
+
+    return cache_put(key, generation, buf, range);
+}
+
+// Message format asked for with ?ts=1 or ?format=json|ndjson
+static int server_request_format(const ph_http_request_t *req)
+{
+    char value[8];
+
+    if (http_query_value(req->path, "format", value, sizeof(value)) >= 0)
+    {
+        if (strcmp(value, "json") == 0)
+            return PH_FORMAT_JSON;
+        if (strcmp(value, "ndjson") == 0)
+            return PH_FORMAT_NDJSON;
+    }
+    if (http_query_value(req->path, "ts", value, sizeof(value)) >= 0 &&
+        strcmp(value, "1") == 0)
+        return PH_FORMAT_TS;
+
+    return PH_FORMAT_RAW;
+}
+
+// Sends a body copied out of the message store and frees it
+static long int server_send_body(ph_server_t *server, ph_conn_t *conn,
+                                 char *body, unsigned long int len,
+                                 uint64_t seq, int format, int keep_alive)
+{
+    char header[512];
+    struct iovec iov[2];
+    ph_buf_t *buf;
+    long int rc;
+
+    if (!(buf = buf_wrap(body, len)))
+        return -1;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = http_header_lines(header, sizeof(header), len, NULL, seq,
+                                       format, PH_ENCODING_IDENTITY, NULL,
+                                       keep_alive);
+    iov[1].iov_base = buf->data;
+    iov[1].iov_len = len;
+    rc = server_write(server, conn, iov, 2, buf);
+    buf_unref(buf);
+
+    return rc;
+}
+
+// Returns 1 when the connection must be closed after the response, -1 on
+// send errors
+static int server_handle_request(ph_server_t *server, ph_conn_t *conn,
+                                 ph_http_request_t *req)
+{
+    ph_channel_t *channel = server_request_channel(req);
+    ph_config_t *config = channel ? channel->config : server->config;
+    ph_messages_t *messages = channel ? &channel->messages : NULL;
+    int keep_alive = req->keep_alive;
+    int format = server_request_format(req);
+    char *response = NULL;
+    ph_buf_t *cached = NULL;
+    int sent = 0;
+    long int rc = 0;
+    unsigned long int response_len = 0;
+    void *result = NULL;
+    int type = channel ? http_parse_request(req, &result) : PH_HTTP_ERROR;
+
+    stats_add(&server->stats, requests[type < 0 ? 0 : type], 1);
+
+    if (type == PH_HTTP_ERROR)
+    {
+        response = http_response_error(keep_alive);
+    }
+    else if (type == PH_HTTP_STATS)
+    {
+        char value[16];
+        int prometheus =
+            http_query_value(result, "format", value, sizeof(value)) >= 0 &&
+            strcmp(value, "prometheus") == 0;
+        unsigned long int len;
+        char *body = stats_format(prometheus, &len);
+
+        if (body)
+        {
+            response = http_response_stats(body, len, prometheus, keep_alive);
+            free(body);
+        }
+        else
+        {
+            response = http_response_error(keep_alive);
+        }
+    }
+    else if (type == PH_HTTP_CLEAR)
+    {
+        messages_clear(messages);
+        response = http_response_ok(keep_alive);
+    }
+    else if (type == PH_HTTP_CONFIG)
+    {
+        int changed = http_parse_request_config(result, config);
+
+        if (changed < 0)
+        {
+            response = http_response_error(keep_alive);
+        }
+        else if (changed > 0)
+        {
+            // No options given, show the current ones and the usage
+            unsigned int lines;
+            uint64_t bytes, memory;
+
+            messages_usage(messages, &lines, &bytes, &memory);
+            response = http_response_config(config, lines, bytes, memory,
+                                            keep_alive);
+        }
+        else
+        {
+            response = http_response_ok(keep_alive);
+            // Call list resize even if no config max_lines change
+            messages_resize(messages, config_get(config, max_lines),
+                            config_get(config, max_bytes));
+            messages_rate(messages, config_get(config, rate),
+                          config_get(config, burst),
+                          config_get(config, rate_latest));
+        }
+    }
+    else if (type == PH_HTTP_GREP)
+    {
+        char query[PH_HTTP_MAX_PATH], value[16];
+        int query_len = http_query_value(result, "q", query, sizeof(query));
+        long int max_lines = config_get(config, max_lines);
+        long int limit = max_lines;
+        ph_ring_range_t range;
+        char *body;
+
+        if (http_query_value(result, "limit", value, sizeof(value)) > 0)
+            limit = strtol(value, NULL, 10);
+        if (limit <= 0 || (max_lines && limit > max_lines))
+            limit = max_lines;
+
+        if (query_len <= 0 ||
+            !(body = messages_grep(messages, query, query_len, limit,
+                                   format, config->body_prefix,
+                                   config->body_suffix, config->line_delimiter,
+                                   &response_len, &range)))
+        {
+            response = http_response_error(keep_alive);
+        }
+        else
+        {
+            rc = server_send_body(server, conn, body, response_len,
+                                  range.last, format, keep_alive);
+        }
+    }
+    else if (type == PH_HTTP_TIME_RANGE)
+    {
+        uint64_t from = 0, to = UINT64_MAX;
+        // Either end may be left out
+        int to_set = http_query_time(result, "to", &to);
+        ph_ring_range_t range;
+        char *body;
+
+        // Times are shown in microseconds, to takes in the whole microsecond
+        // so a time shown with ?ts=1 matches its line
+        if (to_set > 0)
+            to += 999;
+        if (to_set < 0 || http_query_time(result, "from", &from) < 0 ||
+            !(body = messages_get_range(messages, from, to, format,
+                                        config->body_prefix,
+                                        config->body_suffix,
+                                        config->line_delimiter,
+                                        &response_len, &range)))
+        {
+            response = http_response_error(keep_alive);
+        }
+        else
+        {
+            rc = server_send_body(server, conn, body, response_len,
+                                  range.last, format, keep_alive);
+        }
+    }
+    else if (type == PH_HTTP_FOLLOW)
+    {
+        char value[16];
+        int follow_format =
+            req->event_stream ? PH_FOLLOW_SSE : PH_FOLLOW_CHUNKED;
+        int close_slow = 0;
+
+        if (http_query_value(result, "format", value, sizeof(value)) >= 0)
+            follow_format = strcmp(value, "sse") == 0 ? PH_FOLLOW_SSE
+                                                      : PH_FOLLOW_CHUNKED;
+        // Chunked encoding is HTTP/1.1 only
+        if (follow_format == PH_FOLLOW_CHUNKED && req->version < 1)
+            follow_format = PH_FOLLOW_RAW;
+        if (http_query_value(result, "overflow", value, sizeof(value)) >= 0)
+            close_slow = strcmp(value, "close") == 0;
+
+        free(result);
+        if (follow_start(server, conn, channel, follow_format, close_slow,
+                         req->version) < 0)
+            return 1;
+        return outq_send(&conn->out, conn->fd) < 0 ? -1 : 0;
+    }
+    else if (type == PH_HTTP_LINES || type == PH_HTTP_SINCE)
+    {
+        long int lines = 0, max_lines = config_get(config, max_lines);
+        uint64_t since = 0;
+        ph_ring_range_t range;
+        ph_http_slice_t slice;
+
+        if (type == PH_HTTP_SINCE)
+        {
+            since = *((uint64_t *)result);
+            debug_print("Since: %llu\n", (unsigned long long)since);
+        }
+        else if (result != NULL)
+        {
+            lines = *((long int *)result);
+            debug_print("Lines: %ld\n", lines);
+        }
+        if (lines > max_lines || lines == 0)
+            lines = max_lines;
+
+        ph_cache_key_t key = {.channel = channel->id,
+                              .lines = lines,
+                              .since = since,
+                              .format = format,
+                              .encoding = req->encoding,
+                              .prefix = config->body_prefix,
+                              .suffix = config->body_suffix,
+                              .line_delimiter = config->line_delimiter};
+        unsigned long int generation = messages_generation(messages);
+        time_t modified = messages_modified(messages);
+        uint64_t epoch = messages_epoch(messages);
+        char etag[PH_HTTP_MAX_ETAG], validators[192];
+
+        // Conditional requests are answered from the store counters alone
+        messages_current_range(messages, since, lines, &range);
+        http_etag(etag, sizeof(etag), epoch, &range, key.prefix, key.suffix,
+                  key.line_delimiter, key.format, key.encoding);
+        if ((type != PH_HTTP_SINCE || messages_cursor_valid(since, &range)) &&
+            http_not_modified(req, etag, modified))
+        {
+            response = http_response_not_modified(etag, modified, range.last,
+                                                  keep_alive);
+            stats_add(&server->stats, not_modified, 1);
+            sent = 1;
+        }
+        else
+        {
+            int seen = 0;
+
+            cached = cache_get(&key, generation, &range, &seen);
+            if (!cached && key.encoding != PH_ENCODING_IDENTITY)
+            {
+                // Compressing costs more than formatting, always keep it
+                cached = server_compress_body(messages, &key, generation,
+                                              &range);
+            }
+            // Workers can't reference messages the writer may replace while
+            // sending and timestamps must be formatted, they serve a copy
+            else if (!cached &&
+                     (seen || !server->writer || format != PH_FORMAT_RAW))
+            {
+                // Repeated request, keep a copy for the next ones
+                char *body = messages_get_formated(
+                    messages, since, lines, format, config->body_prefix,
+                    config->body_suffix, config->line_delimiter,
+                    &response_len, &range);
+                ph_buf_t *buf = body ? buf_wrap(body, response_len) : NULL;
+
+                if (buf)
+                    cached = cache_put(&key, generation, buf, &range);
+            }
+        }
+        if (cached)
+        {
+            response_len = cached->len;
+            // The tag of the body actually sent, it may be newer
+            http_etag(etag, sizeof(etag), epoch, &range, key.prefix,
+                      key.suffix, key.line_delimiter, key.format,
+                      key.encoding);
+            // A part of a body the client doesn't have is no use to it
+            if (!http_range_valid(req, etag, modified))
+                req->range.set = 0;
+            if (type == PH_HTTP_SINCE && !messages_cursor_valid(since, &range))
+            {
+                response = http_response_gone(&range, keep_alive);
+            }
+            else if (http_range_resolve(&req->range, response_len, &slice) ==
+                     PH_HTTP_RANGE_UNSATISFIABLE)
+            {
+                response = http_response_unsatisfiable(response_len,
+                                                       keep_alive);
+            }
+            else
+            {
+                char header[512];
+                struct iovec iov[2];
+
+                http_header_validators(validators, sizeof(validators), etag,
+                                       modified);
+                iov[0].iov_base = header;
+                iov[0].iov_len = http_header_lines(
+                    header, sizeof(header), response_len,
+                    req->range.set ? &slice : NULL, range.last, key.format,
+                    key.encoding, validators, keep_alive);
+                iov[1].iov_base = cached->data + slice.start;
+                iov[1].iov_len = slice.len;
+                // Queued output keeps its own reference, the cache may drop
+                // the body meanwhile
+                rc = server_write(server, conn, iov, 2, cached);
+            }
+            sent = 1;
+        }
+        else if (server->writer && !sent)
+        {
+            char header[512];
+            int iovcnt = 0;
+            ph_ring_view_t view;
+
+            messages_read_begin(messages, &view);
+            messages_view_since(&view, since);
+            messages_view_range(&view, lines, &range);
+            if (type == PH_HTTP_SINCE && !messages_cursor_valid(since, &range))
+            {
+                response = http_response_gone(&range, keep_alive);
+                sent = 1;
+            }
+            else
+            {
+                struct iovec *iov;
+
+                http_etag(etag, sizeof(etag), epoch, &range, key.prefix,
+                          key.suffix, key.line_delimiter, key.format,
+                          key.encoding);
+                http_header_validators(validators, sizeof(validators), etag,
+                                       modified);
+                if (!http_range_valid(req, etag, modified))
+                    req->range.set = 0;
+                iov = http_response_lines_iov(
+                    &view, header, sizeof(header), lines, config->body_prefix,
+                    config->body_suffix, config->line_delimiter, &req->range,
+                    validators, keep_alive, &iovcnt);
+                if (iov)
+                {
+                    // What the socket doesn't take is copied, the store
+                    // may reuse that space before it is sent
+                    rc = server_write(server, conn, iov, iovcnt, NULL);
+                    free(iov);
+                    cache_put(&key, generation, NULL, NULL);
+                    sent = 1;
+                }
+            }
+            messages_read_end(messages, &view, range.first);
+        }
+        if (!sent)
+        {
+            response = http_response_error(keep_alive);
+        }
+    }
+    else
+    {
+        response = http_response_error(keep_alive);
+    }
+    free(result);
+
+    if (response)
+    {
+        struct iovec iov = {.iov_base = response, .iov_len = strlen(response)};
+        rc = server_write(server, conn, &iov, 1, NULL);
+        free(response);
+    }
+
+    if (rc < 0)
+    {
+        perror("send() error");
+        return -1;
+    }
+    stats_add(&server->stats, bytes_sent, rc);
+
+    return keep_alive ? 0 : 1;
+}
+
+// Handles every complete request in the connection buffer, in order. A
+// request waits while an earlier response is still queued. Returns 1 when the
+// connection must be closed after its output, -1 when right away.
+static int server_process_input(ph_server_t *server, ph_conn_t *conn)
+{
+    ph_http_request_t req;
+    struct timespec start;
+    int rc;
+
+    while (conn->in_len > 0)
+    {
+        // Followers only get messages pushed, anything they send is ignored
+        if (conn->follow)
+        {
+            conn->in_len = 0;
+            return 0;
+        }
+
+        if (!outq_empty(&conn->out))
+            return 0;
+
+        rc = http_parse(conn->in, conn->in_len, &conn->in_scanned, &req);
+
+        if (rc == 0)
+            return 0;
+
+        if (rc < 0)
+        {
+            char *response = http_response_error(0);
+            if (response)
+            {
+                struct iovec iov = {.iov_base = response,
+                                    .iov_len = strlen(response)};
+                rc = server_write(server, conn, &iov, 1, NULL);
+                free(response);
+            }
+            return rc < 0 ? -1 : 1;
+        }
+
+        debug_print("Request: %s %s HTTP/1.%d keep-alive: %d\n", req.method,
+                    req.path, req.version, req.keep_alive);
+
+        conn->in_len -= rc;
+        conn->in_scanned = 0;
+        memmove(conn->in, conn->in + rc, conn->in_len);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rc = server_handle_request(server, conn, &req);
+        stats_latency(&server->stats, &start);
+        if (rc != 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static void server_read_client(ph_server_t *server, ph_conn_t *conn)
+{
+    int close_connection = 0;
+    int rc;
+
+    // Nothing more is handled once the last response is decided
+    if (conn->closing)
+        return;
+
+    do
+    {
+        if (conn->in_len == conn->in_size)
+        {
+            unsigned int size = conn->in_size ? conn->in_size * 2 : READ_BUF_LEN;
+            char *in;
+
+            // Pipelined requests stay in the socket until the output drains
+            if (!outq_empty(&conn->out))
+                break;
+
+            // A full buffer without a complete request was rejected already
+            if (size > PH_HTTP_MAX_REQUEST * 2 ||
+                !(in = (char *)realloc(conn->in, size)))
+            {
+                close_connection = -1;
+                break;
+            }
+            conn->in = in;
+            conn->in_size = size;
+        }
+
+        rc = recv(conn->fd, conn->in + conn->in_len,
+                  conn->in_size - conn->in_len, 0);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("recv() error");
+                close_connection = -1;
+            }
+            break;
+        }
+        if (rc == 0)
+        {
+            // The client may only have shut down its side, finish sending
+            debug_print("%s", "Connection closed\n");
+            close_connection = 1;
+            break;
+        }
+        conn->in_len += rc;
+
+        if ((close_connection = server_process_input(server, conn)))
+            break;
+    } while (1);
+
+    if (close_connection < 0)
+        server_close(server, conn);
+    else if (close_connection > 0)
+        server_finish(server, conn);
+}
+
+static void server_write_client(ph_server_t *server, ph_conn_t *conn)
+{
+    int rc = outq_send(&conn->out, conn->fd);
+
+    if (rc < 0)
+    {
+        server_close(server, conn);
+        return;
+    }
+    // Followers stay registered for writable events
+    if (rc > 0 || conn->follow)
+        return;
+
+    if (conn->closing || server_want_write(server, conn, 0) < 0)
+    {
+        server_close(server, conn);
+        return;
+    }
+
+    // Carry on with requests that waited for the output
+    if ((rc = server_process_input(server, conn)) < 0)
+        server_close(server, conn);
+    else if (rc > 0)
+        server_finish(server, conn);
+    else
+        server_read_client(server, conn);
+}
+
+// Stores the messages rate limiting held back in latest mode once they are
+// allowed. Returns the event wait timeout, cut short to when the next one is
+// due.
+static int server_flush_pending(ph_server_t *server, int timeout)
+{
+    unsigned int i, stored = 0;
+
+    for (i = 0; i < channels_count(); i++)
+    {
+        ph_channel_t *channel = channel_get(i);
+        int wait = messages_flush_pending(&channel->messages,
+                                          ingest_output(channel));
+
+        if (wait == 0)
+            stored = 1;
+        else if (wait > 0 && (timeout < 0 || wait < timeout))
+            timeout = wait;
+    }
+    if (stored)
+        follow_notify(server);
+
+    return timeout;
+}
+
+int server_run(ph_server_t *server)
+{
+    ph_event_t events[PH_SERVER_MAX_EVENTS];
+    int n, i, timeout, wait;
+
+    while (!__atomic_load_n(&server->shutdown, __ATOMIC_ACQUIRE))
+    {
+        // Inactivity is tracked across all servers, only the writer acts on it
+        timeout = server->writer ? config_get(server->config, timeout) : -1;
+        if (timeout > 0)
+            timeout *= 1000;
+        // The writer also reads the inputs
+        if (server->writer)
+            timeout = server_flush_pending(server, timeout);
+        wait = timer_next(&server->timers, timer_now_ms());
+        if (wait >= 0 && (timeout < 0 || wait < timeout))
+            timeout = wait;
+
+        n = event_wait(&server->loop, events, timeout);
+        server->now = timer_now_ms();
+        server_expire(server);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait() error");
+            return -1;
+        }
+
+        if (n == 0)
+        {
+            struct timespec ts;
+
+            // Woken up for a held back message
+            if ((timeout = config_get(server->config, timeout)) < 0)
+                continue;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            if (ts.tv_sec - __atomic_load_n(&server_last_activity,
+                                            __ATOMIC_RELAXED) <
+                timeout)
+                continue;
+            fprintf(stderr, "  epoll_wait() timed out.\n");
+            break;
+        }
+        server_touch();
+
+        for (i = 0; i < n; i++)
+        {
+            ph_conn_t *conn = conn_get(&server->conns, events[i].fd);
+
+            // Closed earlier in this round
+            if (!conn)
+                continue;
+
+            debug_print("fd=%d; events: %s%s%s\n", conn->fd,
+                        (events[i].events & PH_EVENT_IN) ? "IN " : "",
+                        (events[i].events & PH_EVENT_HUP) ? "HUP " : "",
+                        (events[i].events & PH_EVENT_ERR) ? "ERR " : "");
+
+            switch (conn->type)
+            {
+            case PH_CONN_LISTEN:
+                server_accept(server);
+                break;
+            case PH_CONN_NOTIFY:
+                server_read_notify(server, conn);
+                break;
+            case PH_CONN_CLIENT:
+                if (events[i].events & PH_EVENT_OUT)
+                {
+                    server_write_client(server, conn);
+                    // The write may have closed it
+                    if (!(conn = conn_get(&server->conns, events[i].fd)))
+                        break;
+                }
+                if (events[i].events & (PH_EVENT_IN | PH_EVENT_HUP |
+                                        PH_EVENT_ERR))
+                    server_read_client(server, conn);
+                if ((conn = conn_get(&server->conns, events[i].fd)))
+                    server_deadline(server, conn);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
 void server_print_error(int err)
 {
     switch (err)
@@ -7,9 +7,22 @@
 #ifndef __PH_SERVER_H
 #define __PH_SERVER_H
 
+#include <stdint.h>
+#include <sys/uio.h>
+
 #include "config.h"
+#include "conn.h"
+#include "event.h"
+#include "stats.h"
 
 #define PH_SERVER_BACKLOG 32
+#define PH_SERVER_MAX_EVENTS 256
+// Descriptors kept free for listeners, inputs and files
+#define PH_SERVER_RESERVED_FDS 64
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 #define PH_SERVER_ERROR_SOCKET      -50
 #define PH_SERVER_ERROR_FCNTL       -51
@@ -17,8 +30,39 @@
 #define PH_SERVER_ERROR_BIND        -53
 #define PH_SERVER_ERROR_LISTEN      -54
 
+// Followers of one channel on this server and the last sequence they got
+typedef struct ph_server_follow_ {
+    ph_conn_t *followers;
+    uint64_t seq;
+} ph_server_follow_t;
+
+typedef struct ph_server_ {
+    ph_config_t *config;
+    ph_event_loop_t loop;
+    ph_conn_table_t conns;
+    int listen_fd;
+    int notify_fd;
+    int writer;
+    int shutdown;
+    ph_server_follow_t *follow;
+    unsigned int followers_count;
+    int follow_pending;
+    // Connection deadlines, now is the time of the last wakeup in ms
+    ph_timer_wheel_t timers;
+    uint64_t now;
+    ph_stats_t stats;
+} ph_server_t;
 
 int server_setup_socket(ph_config_t *config);
+long int server_send_iov(int fd, struct iovec *iov, int iovcnt);
+int server_init(ph_server_t *server, ph_config_t *config, int listen_fd,
+                int writer);
+int server_run(ph_server_t *server);
+void server_notify(ph_server_t *server);
+void server_close(ph_server_t *server, ph_conn_t *conn);
+void server_deadline(ph_server_t *server, ph_conn_t *conn);
+void server_stop(ph_server_t *server);
+void server_free(ph_server_t *server);
 void server_print_error(int err);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,303 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#include "stats.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+#include "debug.h"
+#include "messages.h"
+
+static ph_stats_t *stats_threads[PH_STATS_MAX_THREADS];
+static time_t stats_started;
+
+static const uint64_t stats_bounds[PH_STATS_BUCKETS] = PH_STATS_BUCKET_BOUNDS;
+static const char *stats_request_names[PH_STATS_REQ_MAX] = {
+    "error", "lines", "clear", "config", "follow", "since", "stats", "grep",
+    "range"};
+
+// Values of a channel, in stats_channel() order
+#define STATS_CHANNEL_METRICS 8
+static const struct {
+    const char *key;
+    const char *name;
+    const char *type;
+    const char *help;
+} stats_channel_metrics[STATS_CHANNEL_METRICS] = {
+    {"lines_stored", "stored_lines_total", "counter", "Lines stored."},
+    {"bytes_stored", "stored_bytes_total", "counter",
+     "Bytes of lines stored."},
+    {"lines_dropped", "dropped_lines_total", "counter",
+     "Lines dropped by rate limiting."},
+    {"lines_oversize", "oversize_lines_total", "counter",
+     "Lines over max_bytes or the store file size, not stored."},
+    {"lines", "lines", "gauge", "Lines held."},
+    {"bytes", "bytes", "gauge", "Bytes of lines held."},
+    {"memory", "memory_bytes", "gauge", "Memory held for lines."},
+    {"json_bytes", "json_bytes", "gauge",
+     "Bytes of JSON escaped copies of lines held."},
+};
+
+typedef struct stats_out_ {
+    char *data;
+    unsigned long int len;
+    unsigned long int size;
+    int failed;
+} stats_out_t;
+
+void stats_register(ph_stats_t *stats) {
+    int i;
+
+    if (!stats_started) stats_started = time(NULL);
+
+    for (i = 0; i < PH_STATS_MAX_THREADS; i++) {
+        if (!stats_threads[i]) {
+            __atomic_store_n(&stats_threads[i], stats, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+void stats_unregister(ph_stats_t *stats) {
+    int i;
+
+    for (i = 0; i < PH_STATS_MAX_THREADS; i++) {
+        if (stats_threads[i] == stats) {
+            __atomic_store_n(&stats_threads[i], NULL, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// Accounts a request that started at start
+void stats_latency(ph_stats_t *stats, const struct timespec *start) {
+    struct timespec now;
+    uint64_t us;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - start->tv_sec) * 1000000ULL +
+         (now.tv_nsec - start->tv_nsec) / 1000;
+
+    for (i = 0; us > stats_bounds[i]; i++)
+        ;
+    stats_add(stats, latency[i], 1);
+    stats_add(stats, latency_sum, us);
+}
+
+static void stats_sum(ph_stats_t *total) {
+    unsigned int i, k;
+
+    memset(total, 0, sizeof(ph_stats_t));
+
+    for (i = 0; i < PH_STATS_MAX_THREADS; i++) {
+        ph_stats_t *s = __atomic_load_n(&stats_threads[i], __ATOMIC_ACQUIRE);
+        uint64_t *from = (uint64_t *)s, *to = (uint64_t *)total;
+
+        if (!s) continue;
+        // Every field is a 64 bit counter
+        for (k = 0; k < sizeof(ph_stats_t) / sizeof(uint64_t); k++) {
+            to[k] += __atomic_load_n(&from[k], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void stats_channel(ph_channel_t *channel, uint64_t *values) {
+    ph_messages_t *m = &channel->messages;
+    unsigned int lines;
+
+    messages_usage(m, &lines, &values[5], &values[6]);
+    values[0] = messages_stat(m, lines_stored);
+    values[1] = messages_stat(m, bytes_stored);
+    values[2] = messages_stat(m, lines_dropped);
+    values[3] = messages_stat(m, lines_oversize);
+    values[4] = lines;
+    values[7] = messages_json_bytes(m);
+}
+
+static void stats_printf(stats_out_t *out, const char *fmt, ...) {
+    va_list ap;
+    char *data;
+    int n;
+
+    while (!out->failed) {
+        va_start(ap, fmt);
+        n = vsnprintf(out->data + out->len, out->size - out->len, fmt, ap);
+        va_end(ap);
+
+        if (n < 0) {
+            free(out->data);
+            out->data = NULL;
+            out->failed = 1;
+            return;
+        }
+        if ((unsigned long int)n < out->size - out->len) {
+            out->len += n;
+            return;
+        }
+
+        out->size = out->size * 2 + n;
+        if (!(data = realloc(out->data, out->size))) {
+            free(out->data);
+            out->data = NULL;
+            out->failed = 1;
+        }
+        out->data = data;
+    }
+}
+
+static void stats_format_plain(stats_out_t *out, const ph_stats_t *total) {
+    uint64_t count = 0;
+    unsigned int i, k;
+
+    stats_printf(out, "uptime=%ld\n", (long)(time(NULL) - stats_started));
+    stats_printf(out,
+                 "connections=%llu\nconnections_accepted=%llu\n"
+                 "connections_timed_out=%llu\n",
+                 (unsigned long long)(total->accepted - total->closed),
+                 (unsigned long long)total->accepted,
+                 (unsigned long long)total->timed_out);
+    for (i = 0; i < PH_STATS_REQ_MAX; i++) {
+        stats_printf(out, "requests_%s=%llu\n", stats_request_names[i],
+                     (unsigned long long)total->requests[i]);
+    }
+    stats_printf(out, "not_modified=%llu\nbytes_sent=%llu\n",
+                 (unsigned long long)total->not_modified,
+                 (unsigned long long)total->bytes_sent);
+
+    for (i = 0; i < PH_STATS_BUCKETS; i++) {
+        count += total->latency[i];
+        if (i < PH_STATS_BUCKETS - 1) {
+            stats_printf(out, "latency_us_le_%llu=%llu\n",
+                         (unsigned long long)stats_bounds[i],
+                         (unsigned long long)count);
+        } else {
+            stats_printf(out, "latency_us_le_inf=%llu\n",
+                         (unsigned long long)count);
+        }
+    }
+    stats_printf(out, "latency_us_sum=%llu\n",
+                 (unsigned long long)total->latency_sum);
+
+    for (i = 0; i < channels_count(); i++) {
+        ph_channel_t *channel = channel_get(i);
+        uint64_t values[STATS_CHANNEL_METRICS];
+
+        stats_channel(channel, values);
+        for (k = 0; k < STATS_CHANNEL_METRICS; k++) {
+            stats_printf(out, "%s.%s=%llu\n",
+                         channel->name ? channel->name : "stdin",
+                         stats_channel_metrics[k].key,
+                         (unsigned long long)values[k]);
+        }
+    }
+}
+
+static void stats_metric(stats_out_t *out, const char *name, const char *type,
+                         const char *help) {
+    stats_printf(out, "# HELP ph_%s %s\n# TYPE ph_%s %s\n", name, help, name,
+                 type);
+}
+
+// Prometheus text exposition format 0.0.4
+static void stats_format_prometheus(stats_out_t *out,
+                                    const ph_stats_t *total) {
+    uint64_t count = 0;
+    unsigned int i, k;
+
+    stats_metric(out, "uptime_seconds", "gauge", "Seconds since start.");
+    stats_printf(out, "ph_uptime_seconds %ld\n",
+                 (long)(time(NULL) - stats_started));
+
+    stats_metric(out, "connections", "gauge", "Open client connections.");
+    stats_printf(out, "ph_connections %llu\n",
+                 (unsigned long long)(total->accepted - total->closed));
+    stats_metric(out, "connections_accepted_total", "counter",
+                 "Accepted client connections.");
+    stats_printf(out, "ph_connections_accepted_total %llu\n",
+                 (unsigned long long)total->accepted);
+    stats_metric(out, "connections_timed_out_total", "counter",
+                 "Client connections closed by a timeout.");
+    stats_printf(out, "ph_connections_timed_out_total %llu\n",
+                 (unsigned long long)total->timed_out);
+
+    stats_metric(out, "requests_total", "counter", "HTTP requests by type.");
+    for (i = 0; i < PH_STATS_REQ_MAX; i++) {
+        stats_printf(out, "ph_requests_total{type=\"%s\"} %llu\n",
+                     stats_request_names[i],
+                     (unsigned long long)total->requests[i]);
+    }
+    stats_metric(out, "not_modified_total", "counter",
+                 "Requests answered with 304 Not Modified.");
+    stats_printf(out, "ph_not_modified_total %llu\n",
+                 (unsigned long long)total->not_modified);
+    stats_metric(out, "sent_bytes_total", "counter",
+                 "Bytes of responses sent.");
+    stats_printf(out, "ph_sent_bytes_total %llu\n",
+                 (unsigned long long)total->bytes_sent);
+
+    stats_metric(out, "request_duration_seconds", "histogram",
+                 "Time to handle a request.");
+    for (i = 0; i < PH_STATS_BUCKETS; i++) {
+        count += total->latency[i];
+        if (i < PH_STATS_BUCKETS - 1) {
+            stats_printf(out,
+                         "ph_request_duration_seconds_bucket{le=\"%g\"} %llu\n",
+                         stats_bounds[i] / 1e6, (unsigned long long)count);
+        } else {
+            stats_printf(out,
+                         "ph_request_duration_seconds_bucket{le=\"+Inf\"} "
+                         "%llu\n",
+                         (unsigned long long)count);
+        }
+    }
+    stats_printf(out, "ph_request_duration_seconds_sum %g\n",
+                 total->latency_sum / 1e6);
+    stats_printf(out, "ph_request_duration_seconds_count %llu\n",
+                 (unsigned long long)count);
+
+    for (k = 0; k < STATS_CHANNEL_METRICS; k++) {
+        stats_metric(out, stats_channel_metrics[k].name,
+                     stats_channel_metrics[k].type,
+                     stats_channel_metrics[k].help);
+        for (i = 0; i < channels_count(); i++) {
+            ph_channel_t *channel = channel_get(i);
+            uint64_t values[STATS_CHANNEL_METRICS];
+
+            stats_channel(channel, values);
+            stats_printf(out, "ph_%s{channel=\"%s\"} %llu\n",
+                         stats_channel_metrics[k].name,
+                         channel->name ? channel->name : "stdin",
+                         (unsigned long long)values[k]);
+        }
+    }
+}
+
+// Current counters of every thread and channel, the result must be freed
+char *stats_format(int prometheus, unsigned long int *len) {
+    stats_out_t out = {.size = 4096};
+    ph_stats_t total;
+
+    if (!(out.data = malloc(out.size))) return NULL;
+
+    stats_sum(&total);
+    if (prometheus) {
+        stats_format_prometheus(&out, &total);
+    } else {
+        stats_format_plain(&out, &total);
+    }
+
+    if (out.failed) {
+        fprintf(stderr, "Cannot alloc memory for stats\n");
+        return NULL;
+    }
+    *len = out.len;
+
+    return out.data;
+}
\ No newline at end of file
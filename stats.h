@@ -0,0 +1,57 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_STATS_H
+#define __PH_STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define PH_STATS_MAX_THREADS 257
+// Request latency bucket bounds in microseconds, the last bucket is +Inf
+#define PH_STATS_BUCKETS 12
+#define PH_STATS_BUCKET_BOUNDS                                          \
+    {50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, \
+     UINT64_MAX}
+
+// Same order as enum http_result
+enum stats_request {
+    PH_STATS_REQ_ERROR = 0,
+    PH_STATS_REQ_LINES,
+    PH_STATS_REQ_CLEAR,
+    PH_STATS_REQ_CONFIG,
+    PH_STATS_REQ_FOLLOW,
+    PH_STATS_REQ_SINCE,
+    PH_STATS_REQ_STATS,
+    PH_STATS_REQ_GREP,
+    PH_STATS_REQ_RANGE,
+    PH_STATS_REQ_MAX
+};
+
+// Counters of one server thread. Only the owning thread writes them, with
+// plain relaxed stores, scrapes sum every thread's block.
+typedef struct ph_stats_ {
+    uint64_t accepted;
+    uint64_t closed;
+    // Closed by one of the connection timeouts
+    uint64_t timed_out;
+    uint64_t requests[PH_STATS_REQ_MAX];
+    uint64_t not_modified;
+    uint64_t bytes_sent;
+    uint64_t latency[PH_STATS_BUCKETS];
+    uint64_t latency_sum;
+} ph_stats_t;
+
+#define stats_add(stats, field, n)                                   \
+    __atomic_store_n(&(stats)->field, (stats)->field + (n),          \
+                     __ATOMIC_RELAXED)
+
+void stats_register(ph_stats_t *stats);
+void stats_unregister(ph_stats_t *stats);
+void stats_latency(ph_stats_t *stats, const struct timespec *start);
+char *stats_format(int prometheus, unsigned long int *len);
+
+#endif
\ No newline at end of file
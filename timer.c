@@ -0,0 +1,179 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#include "timer.h"
+
+#include <string.h>
+#include <time.h>
+
+#define PH_TIMER_MASK (PH_TIMER_SLOTS - 1)
+// Furthest a timer is placed ahead of the current tick
+#define PH_TIMER_SPAN (1ULL << (PH_TIMER_BITS * PH_TIMER_LEVELS))
+
+uint64_t timer_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(ph_timer_wheel_t *w, uint64_t now_ms) {
+    memset(w, 0, sizeof(ph_timer_wheel_t));
+    w->now = now_ms / PH_TIMER_TICK_MS;
+}
+
+void timer_init(ph_timer_t *t, void *arg) {
+    t->prev = t->next = NULL;
+    t->expires = 0;
+    t->list = -1;
+    t->arg = arg;
+}
+
+static void timer_push(ph_timer_wheel_t *w, ph_timer_t *t, int list) {
+    t->list = list;
+    t->prev = NULL;
+    t->next = w->lists[list];
+    if (t->next) t->next->prev = t;
+    w->lists[list] = t;
+
+    if (list < PH_TIMER_EXPIRED) {
+        w->used[list / PH_TIMER_SLOTS] |= 1ULL << (list & PH_TIMER_MASK);
+        w->count++;
+    }
+}
+
+static void timer_unlink(ph_timer_wheel_t *w, ph_timer_t *t) {
+    int list = t->list;
+
+    if (t->prev) t->prev->next = t->next;
+    else w->lists[list] = t->next;
+    if (t->next) t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+    t->list = -1;
+
+    if (list < PH_TIMER_EXPIRED) {
+        if (!w->lists[list]) {
+            w->used[list / PH_TIMER_SLOTS] &= ~(1ULL << (list & PH_TIMER_MASK));
+        }
+        w->count--;
+    }
+}
+
+// Puts t in the level whose slots are as wide as its distance, slots of a
+// level are indexed by the tick bits of that level
+static void timer_link(ph_timer_wheel_t *w, ph_timer_t *t) {
+    uint64_t expires = t->expires, delta;
+    unsigned int level = 0;
+
+    if (expires <= w->now) {
+        timer_push(w, t, PH_TIMER_EXPIRED);
+        return;
+    }
+
+    delta = expires - w->now;
+    // Moved down again when the last slot is reached
+    if (delta >= PH_TIMER_SPAN) {
+        expires = w->now + PH_TIMER_SPAN - 1;
+        delta = PH_TIMER_SPAN - 1;
+    }
+    while (level < PH_TIMER_LEVELS - 1 &&
+           delta >= 1ULL << (PH_TIMER_BITS * (level + 1))) {
+        level++;
+    }
+
+    timer_push(w, t,
+               level * PH_TIMER_SLOTS +
+                   ((expires >> (PH_TIMER_BITS * level)) & PH_TIMER_MASK));
+}
+
+// Sets t to expire at expires_ms, replacing the time it was set for
+void timer_set(ph_timer_wheel_t *w, ph_timer_t *t, uint64_t expires_ms) {
+    if (timer_pending(t)) timer_unlink(w, t);
+
+    // Rounded up, a timer never fires early
+    t->expires = (expires_ms + PH_TIMER_TICK_MS - 1) / PH_TIMER_TICK_MS;
+    timer_link(w, t);
+}
+
+void timer_cancel(ph_timer_wheel_t *w, ph_timer_t *t) {
+    if (timer_pending(t)) timer_unlink(w, t);
+}
+
+// Relinks the timers of a slot, they land in lower levels or expire
+static void timer_cascade(ph_timer_wheel_t *w, int list) {
+    ph_timer_t *t;
+
+    while ((t = w->lists[list])) {
+        timer_unlink(w, t);
+        timer_link(w, t);
+    }
+}
+
+// Moves the timers due by now_ms to the expired list
+void timer_advance(ph_timer_wheel_t *w, uint64_t now_ms) {
+    uint64_t target = now_ms / PH_TIMER_TICK_MS;
+    unsigned int level, index;
+
+    while (w->now < target) {
+        if (w->count == 0) {
+            w->now = target;
+            break;
+        }
+        // Nothing until the first level wraps, skip to it
+        if (!w->used[0] && (w->now | PH_TIMER_MASK) > w->now) {
+            w->now = w->now | PH_TIMER_MASK;
+            if (w->now >= target) {
+                w->now = target;
+                break;
+            }
+        }
+
+        w->now++;
+        index = w->now & PH_TIMER_MASK;
+        // A wrap brings the next slot of the level above down
+        for (level = 1; index == 0 && level < PH_TIMER_LEVELS; level++) {
+            index = (w->now >> (PH_TIMER_BITS * level)) & PH_TIMER_MASK;
+            timer_cascade(w, level * PH_TIMER_SLOTS + index);
+        }
+        timer_cascade(w, w->now & PH_TIMER_MASK);
+    }
+}
+
+// Takes the next due timer off the wheel, NULL when there are no more
+ph_timer_t *timer_expired(ph_timer_wheel_t *w) {
+    ph_timer_t *t = w->lists[PH_TIMER_EXPIRED];
+
+    if (t) timer_unlink(w, t);
+
+    return t;
+}
+
+// Milliseconds until timer_advance() may find a timer due, -1 without timers
+int timer_next(const ph_timer_wheel_t *w, uint64_t now_ms) {
+    unsigned int shift = (w->now + 1) & PH_TIMER_MASK, level;
+    uint64_t used = w->used[0], ticks, due;
+
+    if (w->lists[PH_TIMER_EXPIRED]) return 0;
+    if (w->count == 0) return -1;
+
+    // The first level wraps and a slot of the levels above comes down
+    ticks = PH_TIMER_SLOTS - (w->now & PH_TIMER_MASK);
+    for (level = 1; level < PH_TIMER_LEVELS && !w->used[level]; level++)
+        ;
+    if (level == PH_TIMER_LEVELS) ticks = PH_TIMER_SLOTS;
+
+    if (used) {
+        // First used slot after the current one
+        if (shift) used = (used >> shift) | (used << (PH_TIMER_SLOTS - shift));
+        if (__builtin_ctzll(used) + 1 < ticks) {
+            ticks = __builtin_ctzll(used) + 1;
+        }
+    }
+
+    due = (w->now + ticks) * PH_TIMER_TICK_MS;
+
+    return due > now_ms ? (int)(due - now_ms) : 0;
+}
\ No newline at end of file
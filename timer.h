@@ -0,0 +1,57 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_TIMER_H
+#define __PH_TIMER_H
+
+#include <stdint.h>
+
+#define PH_TIMER_TICK_MS 100
+// Each level has 64 slots of 64 times the ticks of the level below, four of
+// them cover 19 days. Later timers wait in the last level.
+#define PH_TIMER_BITS 6
+#define PH_TIMER_SLOTS (1 << PH_TIMER_BITS)
+#define PH_TIMER_LEVELS 4
+// List of the timers that are due, after the wheel slots
+#define PH_TIMER_EXPIRED (PH_TIMER_LEVELS * PH_TIMER_SLOTS)
+
+typedef struct ph_timer_ {
+    struct ph_timer_ *prev;
+    struct ph_timer_ *next;
+    // Tick it is due at
+    uint64_t expires;
+    // List it is linked in, -1 when not set
+    int list;
+    void *arg;
+} ph_timer_t;
+
+/*
+ * Hierarchical timer wheel. Setting and cancelling a timer is O(1), a timer
+ * moves down a level at most once per level as its time comes closer. The
+ * bitmaps of used slots let the owner sleep until the next slot with timers
+ * instead of waking up every tick.
+ */
+typedef struct ph_timer_wheel_ {
+    ph_timer_t *lists[PH_TIMER_EXPIRED + 1];
+    uint64_t used[PH_TIMER_LEVELS];
+    // Current tick, everything before it was handled
+    uint64_t now;
+    // Timers in the wheel slots
+    unsigned int count;
+} ph_timer_wheel_t;
+
+void timer_wheel_init(ph_timer_wheel_t *w, uint64_t now_ms);
+void timer_init(ph_timer_t *t, void *arg);
+void timer_set(ph_timer_wheel_t *w, ph_timer_t *t, uint64_t expires_ms);
+void timer_cancel(ph_timer_wheel_t *w, ph_timer_t *t);
+void timer_advance(ph_timer_wheel_t *w, uint64_t now_ms);
+ph_timer_t *timer_expired(ph_timer_wheel_t *w);
+int timer_next(const ph_timer_wheel_t *w, uint64_t now_ms);
+uint64_t timer_now_ms(void);
+
+#define timer_pending(t) ((t)->list >= 0)
+
+#endif
\ No newline at end of file
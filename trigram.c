@@ -0,0 +1,217 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#include "trigram.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+
+// Query trigrams looked up, longer queries only check the rest on the message
+#define TRIGRAM_QUERY_MAX 16
+
+static inline unsigned int trigram_bucket(const unsigned char *p) {
+    uint32_t v = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+
+    return (v * 2654435761U) >> (32 - 16);
+}
+
+// How many messages older than the newest one an entry is. Ages drop from
+// the head to the tail of every list, evicted entries included.
+static inline uint32_t trigram_age(const ph_trigram_t *index, uint32_t low) {
+    return (uint32_t)index->last - low;
+}
+
+int trigram_init(ph_trigram_t *index) {
+    memset(index, 0, sizeof(ph_trigram_t));
+
+    if (!(index->lists = (ph_trigram_list_t *)calloc(
+              PH_TRIGRAM_BUCKETS, sizeof(ph_trigram_list_t)))) {
+        fprintf(stderr, "Cannot allocate trigram index\n");
+        return -1;
+    }
+    pthread_rwlock_init(&index->lock, NULL);
+
+    return 0;
+}
+
+void trigram_clear(ph_trigram_t *index) {
+    unsigned int i;
+
+    for (i = 0; i < PH_TRIGRAM_BUCKETS; i++) {
+        free(index->lists[i].seqs);
+    }
+    memset(index->lists, 0, PH_TRIGRAM_BUCKETS * sizeof(ph_trigram_list_t));
+    index->entries = 0;
+    // Empty like the store, it is complete again
+    index->disabled = 0;
+}
+
+void trigram_free(ph_trigram_t *index) {
+    if (!index->lists) return;
+
+    trigram_clear(index);
+    free(index->lists);
+    index->lists = NULL;
+    pthread_rwlock_destroy(&index->lock);
+}
+
+static int trigram_list_add(ph_trigram_list_t *list, uint32_t seq) {
+    if (list->len > list->head && list->seqs[list->len - 1] == seq) return 0;
+
+    if (list->len == list->size) {
+        // Reuse the space of dropped entries before growing
+        if (list->head > list->size / 2) {
+            memmove(list->seqs, list->seqs + list->head,
+                    (list->len - list->head) * sizeof(uint32_t));
+            list->len -= list->head;
+            list->head = 0;
+        } else {
+            uint32_t size = list->size ? list->size * 2 : 4;
+            uint32_t *seqs = realloc(list->seqs, size * sizeof(uint32_t));
+
+            if (!seqs) return -1;
+            list->seqs = seqs;
+            list->size = size;
+        }
+    }
+    list->seqs[list->len++] = seq;
+
+    return 0;
+}
+
+// Caller holds the write lock. When a list can't grow the index would miss
+// the message, it is emptied and disabled instead and -1 returned.
+int trigram_add(ph_trigram_t *index, uint64_t seq, const char *data,
+                uint32_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    uint32_t i;
+
+    if (index->disabled) return -1;
+
+    index->last = seq;
+    for (i = 0; i + 3 <= len; i++) {
+        ph_trigram_list_t *list = &index->lists[trigram_bucket(p + i)];
+        uint32_t before = list->len;
+
+        if (trigram_list_add(list, (uint32_t)seq) < 0) {
+            fprintf(stderr, "Cannot grow trigram index, disabling it\n");
+            trigram_clear(index);
+            index->disabled = 1;
+            return -1;
+        }
+        index->entries += list->len - before;
+    }
+
+    return 0;
+}
+
+// Drops entries older than first from the next count lists, the caller holds
+// the write lock
+void trigram_sweep(ph_trigram_t *index, uint64_t first, unsigned int count) {
+    // Entries this old or older are evicted
+    uint64_t evicted = index->last + 1 - first;
+
+    if (count > PH_TRIGRAM_BUCKETS) count = PH_TRIGRAM_BUCKETS;
+
+    while (count--) {
+        ph_trigram_list_t *list = &index->lists[index->sweep];
+
+        index->sweep = (index->sweep + 1) % PH_TRIGRAM_BUCKETS;
+        while (list->head < list->len &&
+               trigram_age(index, list->seqs[list->head]) >= evicted) {
+            list->head++;
+            index->entries--;
+        }
+        if (list->head == list->len) {
+            free(list->seqs);
+            memset(list, 0, sizeof(ph_trigram_list_t));
+        }
+    }
+}
+
+// Whether list holds seq, a binary search over the descending ages
+static int trigram_list_has(const ph_trigram_t *index,
+                            const ph_trigram_list_t *list, uint64_t seq) {
+    uint32_t lo = list->head, hi = list->len;
+    uint64_t age = index->last - seq;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint32_t a = trigram_age(index, list->seqs[mid]);
+
+        if (a > age) {
+            lo = mid + 1;
+        } else if (a < age) {
+            hi = mid;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Copies the messages in first..last that may hold query to a new array in
+// *seqs, newest first. The caller holds the read lock only for this, the
+// candidates must still be checked against the messages. Returns their
+// number or -1 when the index can't answer, the query is too short or it
+// is disabled.
+int trigram_search(ph_trigram_t *index, const char *query, unsigned int len,
+                   uint64_t first, uint64_t last, uint64_t **seqs) {
+    const unsigned char *q = (const unsigned char *)query;
+    ph_trigram_list_t *lists[TRIGRAM_QUERY_MAX], *smallest;
+    unsigned int count = 0, i, k;
+    int found = 0;
+    uint32_t n;
+
+    if (len < 3 || index->disabled) return -1;
+
+    // Spread the looked up trigrams over the whole query
+    for (i = 0; i + 3 <= len && count < TRIGRAM_QUERY_MAX; i++) {
+        unsigned int at = len - 3 < TRIGRAM_QUERY_MAX
+                              ? i
+                              : i * (len - 3) / (TRIGRAM_QUERY_MAX - 1);
+        ph_trigram_list_t *list = &index->lists[trigram_bucket(q + at)];
+
+        for (k = 0; k < count && lists[k] != list; k++)
+            ;
+        if (k == count) lists[count++] = list;
+        if (at == len - 3) break;
+    }
+
+    smallest = lists[0];
+    for (k = 1; k < count; k++) {
+        if (lists[k]->len - lists[k]->head < smallest->len - smallest->head)
+            smallest = lists[k];
+    }
+
+    // At most every entry of the smallest list is a candidate
+    if (!(*seqs = (uint64_t *)malloc(
+              ((uint64_t)smallest->len - smallest->head + 1) *
+              sizeof(uint64_t)))) {
+        return -1;
+    }
+    if (last > index->last) last = index->last;
+
+    for (n = smallest->len; n > smallest->head; n--) {
+        uint64_t age = trigram_age(index, smallest->seqs[n - 1]);
+        uint64_t seq = index->last - age;
+
+        if (age > index->last || seq < first) break;
+        if (seq > last) continue;
+
+        for (k = 0; k < count; k++) {
+            if (lists[k] != smallest &&
+                !trigram_list_has(index, lists[k], seq))
+                break;
+        }
+        if (k == count) (*seqs)[found++] = seq;
+    }
+
+    return found;
+}
\ No newline at end of file
@@ -0,0 +1,59 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_TRIGRAM_H
+#define __PH_TRIGRAM_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+// Trigrams are hashed into this many posting lists
+#define PH_TRIGRAM_BUCKETS (1 << 16)
+// Lists checked for evicted entries per message inserted
+#define PH_TRIGRAM_SWEEP 64
+
+// Ascending sequence numbers of the messages holding a trigram, kept as the
+// low 32 bits. Evicted entries are dropped from the head.
+typedef struct ph_trigram_list_ {
+    uint32_t *seqs;
+    uint32_t head;
+    uint32_t len;
+    uint32_t size;
+} ph_trigram_list_t;
+
+/*
+ * Substring index of the stored messages. The writer thread adds each message
+ * as it is stored and sweeps evicted ones off the list heads a few lists at a
+ * time. Queries take the lock shared only to copy out the candidates, which
+ * are checked against the messages after it is released, as different
+ * trigrams share lists.
+ */
+typedef struct ph_trigram_ {
+    ph_trigram_list_t *lists;
+    pthread_rwlock_t lock;
+    unsigned int sweep;
+    uint64_t entries;
+    // Newest message added, entries are stored relative to it
+    uint64_t last;
+    // Set when a list couldn't grow, the index misses messages and isn't
+    // used until it is cleared
+    int disabled;
+} ph_trigram_t;
+
+int trigram_init(ph_trigram_t *index);
+void trigram_free(ph_trigram_t *index);
+void trigram_clear(ph_trigram_t *index);
+int trigram_add(ph_trigram_t *index, uint64_t seq, const char *data,
+                uint32_t len);
+void trigram_sweep(ph_trigram_t *index, uint64_t first, unsigned int count);
+int trigram_search(ph_trigram_t *index, const char *query, unsigned int len,
+                   uint64_t first, uint64_t last, uint64_t **seqs);
+
+#define trigram_write_lock(index) pthread_rwlock_wrlock(&(index)->lock)
+#define trigram_read_lock(index) pthread_rwlock_rdlock(&(index)->lock)
+#define trigram_unlock(index) pthread_rwlock_unlock(&(index)->lock)
+
+#endif
\ No newline at end of file
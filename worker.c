@@ -0,0 +1,91 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#include "worker.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "debug.h"
+
+static ph_worker_t *workers = NULL;
+static unsigned int workers_count = 0;
+
+static void *worker_run(void *arg) {
+    ph_worker_t *worker = (ph_worker_t *)arg;
+
+    debug_print("Worker %u started\n", worker->id);
+    server_run(&worker->server);
+    // Response cache is per thread
+    cache_clear();
+    debug_print("Worker %u stopped\n", worker->id);
+
+    return NULL;
+}
+
+// Starts config->workers HTTP threads, each with its own SO_REUSEPORT
+// listener and event loop. Messages are only read by workers, all writes stay
+// on the thread owning the inputs.
+int workers_start(ph_config_t *config) {
+    unsigned int i;
+    int listen_fd, rc;
+
+    if (config->workers > PH_WORKERS_MAX) config->workers = PH_WORKERS_MAX;
+
+    if (!(workers = (ph_worker_t *)calloc(config->workers,
+                                          sizeof(ph_worker_t)))) {
+        fprintf(stderr, "Cannot allocate workers\n");
+        return -1;
+    }
+
+    for (i = 0; i < config->workers; i++) {
+        ph_worker_t *worker = &workers[i];
+
+        worker->id = i;
+
+        if ((listen_fd = server_setup_socket(config)) < 0) {
+            server_print_error(listen_fd);
+            workers_stop();
+            return -1;
+        }
+
+        if (server_init(&worker->server, config, listen_fd, 0) < 0) {
+            close(listen_fd);
+            workers_stop();
+            return -1;
+        }
+
+        if ((rc = pthread_create(&worker->thread, NULL, worker_run, worker))) {
+            fprintf(stderr, "Cannot start worker: %s\n", strerror(rc));
+            server_free(&worker->server);
+            workers_stop();
+            return -1;
+        }
+        workers_count++;
+    }
+
+    return 0;
+}
+
+void workers_stop(void) {
+    unsigned int i;
+
+    for (i = 0; i < workers_count; i++) {
+        server_stop(&workers[i].server);
+    }
+
+    for (i = 0; i < workers_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        server_free(&workers[i].server);
+    }
+
+    free(workers);
+    workers = NULL;
+    workers_count = 0;
+}
@@ -0,0 +1,26 @@
+/*
+ *    Author: Nicu Pavel <npavel@linuxconsulting.ro>
+ *    Copyright (c) 2021 Green Electronics LLC
+ *    The MIT License (MIT)
+ *
+ */
+#ifndef __PH_WORKER_H
+#define __PH_WORKER_H
+
+#include <pthread.h>
+
+#include "config.h"
+#include "server.h"
+
+#define PH_WORKERS_MAX 256
+
+typedef struct ph_worker_ {
+    unsigned int id;
+    pthread_t thread;
+    ph_server_t server;
+} ph_worker_t;
+
+int workers_start(ph_config_t *config);
+void workers_stop(void);
+
+#endif